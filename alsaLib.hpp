@@ -1,6 +1,8 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <mutex>
+#include <chrono>
 #include <alsa/asoundlib.h>
 #include <iostream>
 #include "wavheader.hpp"
@@ -26,8 +28,8 @@ class PCM {
 	_snd_pcm_format _format;
 
 	public:
-	snd_pcm_hw_params_t *params;
-	snd_pcm_t *pcm;
+	snd_pcm_hw_params_t *params = nullptr;
+	snd_pcm_t *pcm = nullptr;
 	PCM() {}
 	PCM(std::string device, _snd_pcm_stream stream, int mode) { open(device, stream, mode); }
 
@@ -90,7 +92,6 @@ class PCM {
 	void paramsApply() {
 		int error;
 		if ((error = snd_pcm_hw_params(pcm, params)) < 0) throw error;
-		snd_pcm_hw_params_free(params);
 	}
 
 	std::string getName() {
@@ -212,6 +213,40 @@ class PCM {
 		return snd_pcm_avail(pcm);
 	}
 
+	snd_pcm_sframes_t delay() {
+		snd_pcm_sframes_t frames;
+
+		int error;
+		if ((error = snd_pcm_delay(pcm, &frames)) < 0) throw error;
+		return frames;
+	}
+
+	// Delay and the timestamp it was taken at from one status read, so both describe the same instant.
+	// The timestamp is only filled in once setTimestamps() was applied.
+	snd_pcm_sframes_t status(snd_htimestamp_t& tstamp) {
+		snd_pcm_status_t *st;
+		snd_pcm_status_alloca(&st);
+
+		int error;
+		if ((error = snd_pcm_status(pcm, st)) < 0) throw error;
+
+		snd_pcm_status_get_htstamp(st, &tstamp);
+		return snd_pcm_status_get_delay(st);
+	}
+
+	// Enables status timestamps from CLOCK_MONOTONIC, call after paramsApply.
+	// Plugins that cannot pick the clock keep their default one.
+	void setTimestamps() {
+		snd_pcm_sw_params_t *swparams;
+		snd_pcm_sw_params_alloca(&swparams);
+
+		int error;
+		if ((error = snd_pcm_sw_params_current(pcm, swparams)) < 0) throw error;
+		if ((error = snd_pcm_sw_params_set_tstamp_mode(pcm, swparams, SND_PCM_TSTAMP_ENABLE)) < 0) throw error;
+		snd_pcm_sw_params_set_tstamp_type(pcm, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+		if ((error = snd_pcm_sw_params(pcm, swparams)) < 0) throw error;
+	}
+
 	void drain() {
 		int error;
 		if ((error = snd_pcm_drain(pcm)) < 0) throw error;
@@ -223,10 +258,14 @@ class PCM {
 		if ((error = snd_pcm_drop(pcm)) < 0) throw error;
 	}
 
+	// params are kept until close, so the getters stay valid after paramsApply
 	void close() {
 		isopened = false;
-		snd_pcm_close(pcm);
 		snd_pcm_hw_free(pcm);
+		snd_pcm_close(pcm);
+		snd_pcm_hw_params_free(params);
+		pcm = nullptr;
+		params = nullptr;
 	}
 
 	void pcm_exit() {
@@ -234,7 +273,24 @@ class PCM {
 		isopened = false;
 	}
 
-	std::vector<std::string> cardlist() {
+	bool opened() {
+		return isopened;
+	}
+
+	// snd_device_name_hint probes every card, so the list is built once per process
+	// and shared by all PCMs. refresh rebuilds it, e.g. after a device was plugged in,
+	// but at most every 5 seconds so retry loops do not keep probing.
+	std::vector<std::string> cardlist(bool refresh = false) {
+		static std::mutex mtx;
+		static std::vector<std::string> cache;
+		static bool cached = false;
+		static std::chrono::steady_clock::time_point built;
+
+		std::lock_guard<std::mutex> lock(mtx);
+
+		auto now = std::chrono::steady_clock::now();
+		if (cached && (!refresh || now - built < std::chrono::seconds(5))) return cache;
+
 		std::vector<std::string> list;
 		char **hints;
 
@@ -255,6 +311,10 @@ class PCM {
 
 		snd_device_name_free_hint((void**)hints);
 
+		cache = list;
+		cached = true;
+		built = now;
+
 		return list;
 	}
 
@@ -3,37 +3,50 @@
 #include <string>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <map>
 #include <vector>
 #include <chrono>
 #include <cstring>
 #include <csignal>
 #include <limits>
-#include <samplerate.h>
-#include <soxr.h>
+#include <cstdint>
+#include <pthread.h>
 #include "alsaLib.hpp"
 #include "cpplibs/ssocket.hpp"
 #include "cpplibs/argparse.hpp"
 #include "cpplibs/libcbuf.hpp"
 #include "utils/sndutils.hpp"
+#include "utils/jitter.hpp"
+#include "utils/drift.hpp"
+#include "utils/codec.hpp"
+#include "utils/dsp.hpp"
+#include "utils/chmap.hpp"
+#include "utils/convert.hpp"
+#include "utils/protocol.hpp"
+#include "utils/handshake.hpp"
+#include "utils/spsc.hpp"
+#include "utils/wavfile.hpp"
 using namespace std;
 
-mutex mgr_mtx;
-
 enum client_state {
     RUNNING,
     STOP,
     PAUSE
 };
 
-enum tail_stream_mode_t {
-    PLAYBACK,
-    CAPTURE,
-	CAPTURE_PB
+struct tail_pcm_timing_t {
+    snd_pcm_sframes_t delay = 0;
+    snd_htimestamp_t tstamp = {};
 };
 
+struct tail_sink_t;
+
 struct client_t {
     Socket sock;
+    tail_sink_t* sink = nullptr;
+    int id = 0;
     client_state state;
     wav_header_t header;
     tail_stream_mode_t mode;
@@ -41,44 +54,158 @@ struct client_t {
     CircularBuffer buffer;
     size_t buffer_size = 0;
 
+    // compressed streams: playback is decoded into the ring by decoder_thread
+    // (buffer_mtx guards the ring against it), capture is handed to encoder_thread
+    // through encode_ring, so neither codec runs on the realtime threads
+    codec_t codec = CODEC_PCM;
+    codec_encoder_t* encoder = nullptr;
+    spsc_ring_t* encode_ring = nullptr;
+    thread decoder_thread;
+    thread encoder_thread;
+    atomic<bool> codec_stop = false;
+    mutex buffer_mtx;
+
+    // adaptive jitter buffer: the ring is refilled up to target_fill + chunk_size,
+    // chunk_size is the largest message the client is allowed to send
+    jitter_estimator_t jitter;
+    size_t target_fill = 0;
+    size_t chunk_size = 0;
+
+    // a message read before the ring had room for it. The socket is polled every period,
+    // so arrivals are timestamped within a period of coming in, not when the ring needs them.
+    // rx_held: its ack was withheld, so the next message is paced by us, not the network
+    string rx_pending;
+    bool rx_held = false;
+
+    // drift compensation: variable-ratio resampler pulling from the ring
+    drift_estimator_t drift;
+    SRC_STATE* drift_src = nullptr;
+    char* drift_raw = nullptr;
+    float* drift_in = nullptr;
+    float* drift_out = nullptr;
+
     int volume = 100;
+
+    // playback gain, balance and EQ, guarded by buffer_mtx
+    dsp_chain_t dsp;
+
+    // client layout to sink layout for playback, the other way round for capture
+    chmap_t chmap;
     
     int capture_pb_id = 0;
 
     bool drm_playback = false;
+    tail_stream_class_t stream_class = CLASS_MUSIC;
+
+    // one converted period, filled by whichever mix worker picks the client up
+    char* mix_buffer = nullptr;
+    size_t mix_size = 0;
+
+    // frames of the client stream passed through the mixer,
+    // and how many of them had reached the device at the last pcm timing update
+    uint64_t frames_mixed = 0;
+    uint64_t frames_submitted = 0;
+    uint64_t underruns = 0;
+
+    // drain: once the ring has run dry the mixer counts down the device delay in drain_left,
+    // then sets drained and signals the sink's drain_cv. Guarded by the sink mutex
+    bool draining = false;
+    bool drained = false;
+    snd_pcm_sframes_t drain_left = -1;
+
+    // server-side recording of the converted stream, guarded by the sink mutex
+    wav_writer_t* recorder = nullptr;
+
+    // file sources have no sockets, the ring is refilled from the mapped file
+    wav_reader_t* file = nullptr;
+    size_t file_pos = 0;
 };
 
-struct tail_sound_convert_t {
-    const char* inbuf;
-    char* outbuf;
-    int inWidth;
-    int outWidth;
-    int inChannels;
-    int outChannels;
-    int inRate;
-    int outRate;
-    int volume;
-    size_t inSize;
+// Workers claim clients from a shared job list, so a slow stream does not hold up the others
+struct tail_mix_pool_t {
+    vector<thread> workers;
+    mutex mtx;
+    condition_variable cv;
+    condition_variable done_cv;
+
+    uint64_t generation = 0;
+    size_t pending = 0;
+    bool stop = false;
+
+    vector<pair<int, client_t*>> jobs;
+    atomic<size_t> next = 0;
+};
+
+// One output device with its own format, clients and io threads
+struct tail_sink_t {
+    string name;
+    string device;
+    int width = 16;
+    int rate = 48000;
+    int channels = 2;
+    int period = 256;
+    size_t buffer_size = 0;
+
+    PCM playback;
+    PCM capture;
+
+    mutex mtx;
+    condition_variable wake;
+    condition_variable drain_cv;
+    map<int, client_t*> clients;
+
+    // running playback clients in id order, the only ones the mixer visits. Guarded by mtx
+    vector<pair<int, client_t*>> active;
+
+    tail_pcm_timing_t playback_timing;
+    tail_pcm_timing_t capture_timing;
+
+    // the devices are opened by the playback thread while clients are already being accepted,
+    // handshakes wait for ready. open_failed is set once the first attempt failed. Guarded by mtx
+    bool ready = false;
+    bool open_failed = false;
+
+    // hot reconfiguration: requested by a control client, applied by the playback thread
+    // while the capture thread is parked
+    string reconfigure_spec;
+    bool reconfigure = false;
+    bool reconfigure_ok = false;
+    bool capture_parked = false;
+
+    // ducking: envelope of each stream class and the gain it was mixed with last period
+    float class_envelope[CLASS_COUNT] = {};
+    float class_gain[CLASS_COUNT] = {1, 1, 1, 1};
+
+    // master bus recording (without DRM streams), guarded by mtx
+    wav_writer_t* recorder = nullptr;
+
+    thread playback_thread;
+    thread capture_thread;
+
+    tail_mix_pool_t pool;
 };
 
 Socket sockpl;
 Socket sockmgr;
 
-PCM pcm_playback;
-PCM pcm_capture;
-
 string defaultDevice;
 int defaultWidth = 16;
 int defaultRate = 48000;
 int defaultChannels = 2;
-int defaultPeriod = 0;
+int defaultPeriod = 256;
+int latencyTarget = 0;
+int mixThreads = 0;
+int idleTimeout = 5000;
+int duckLevel = 20;
+int recordSize = 0;
+int recordTime = 0;
 
-bool LibSR = false;
-bool use_resample = false;
+// file sources get negative client ids, network clients use their data port
+atomic<int> fileSourceId = 0;
 
-size_t defaultBufferSize;
+bool drift_compensation = false;
 
-map<int, client_t*> clients;
+vector<tail_sink_t*> sinks;
 
 bool exit_flag = false;
 bool wait_pcm_mtx = false;
@@ -89,410 +216,1603 @@ void sighandler(int e) {
     sockmgr.close(); 
 }
 
-void tail_pcm_playback_init() {
-    pcm_playback.open(defaultDevice, SND_PCM_STREAM_PLAYBACK, 0);
-    pcm_playback.setAccess(SND_PCM_ACCESS_RW_INTERLEAVED);
-    pcm_playback.setFormat(inttoformat(defaultWidth, 1));
-    pcm_playback.setRate(defaultRate);
-    pcm_playback.setChannels(defaultChannels); 
-    pcm_playback.setBufferSize(1024);
-    // pcm_playback.setPeriodSize(256);
+void tail_pcm_playback_init(tail_sink_t* sink) {
+    sink->playback.open(sink->device, SND_PCM_STREAM_PLAYBACK, 0);
+    sink->playback.setAccess(SND_PCM_ACCESS_RW_INTERLEAVED);
+    sink->playback.setFormat(inttoformat(sink->width, 1));
+    sink->playback.setRate(sink->rate);
+    sink->playback.setChannels(sink->channels); 
+    sink->playback.setBufferSize(1024);
+    // sink->playback.setPeriodSize(256);
     // snd_pcm_hw_params_test_period_size
-    pcm_playback.paramsApply();
+    sink->playback.paramsApply();
+    sink->playback.setTimestamps();
 }
 
-void tail_pcm_playback_reinit() {
-    pcm_playback.pcm_exit();
-    tail_pcm_playback_init();
+void tail_pcm_playback_reinit(tail_sink_t* sink) {
+    sink->playback.pcm_exit();
+    tail_pcm_playback_init(sink);
 }
 
-void tail_pcm_capture_init() {
-    pcm_capture.open(defaultDevice, SND_PCM_STREAM_CAPTURE, 0);
-    pcm_capture.setAccess(SND_PCM_ACCESS_RW_INTERLEAVED);
-    pcm_capture.setFormat(inttoformat(defaultWidth, 1));
-    pcm_capture.setRate(defaultRate);
-    pcm_capture.setChannels(defaultChannels); 
-    pcm_capture.setBufferSize(1024);
-    // pcm_capture.setPeriodSize(256);
+void tail_pcm_capture_init(tail_sink_t* sink) {
+    sink->capture.open(sink->device, SND_PCM_STREAM_CAPTURE, 0);
+    sink->capture.setAccess(SND_PCM_ACCESS_RW_INTERLEAVED);
+    sink->capture.setFormat(inttoformat(sink->width, 1));
+    sink->capture.setRate(sink->rate);
+    sink->capture.setChannels(sink->channels); 
+    sink->capture.setBufferSize(1024);
+    // sink->capture.setPeriodSize(256);
     // snd_pcm_hw_params_test_period_size
-    pcm_capture.paramsApply();
+    sink->capture.paramsApply();
+    sink->capture.setTimestamps();
 }
 
-void tail_pcm_capture_reinit() {
-    pcm_capture.pcm_exit();
-    tail_pcm_capture_init();
+void tail_pcm_capture_reinit(tail_sink_t* sink) {
+    sink->capture.pcm_exit();
+    tail_pcm_capture_init(sink);
 }
 
-void tail_pcm_init() {
-    defaultPeriod = 256;
-    defaultBufferSize = defaultPeriod * defaultChannels * (defaultWidth / 8);
+// Opens the playback device, capture is opened on demand by the capture thread
+void tail_pcm_init(tail_sink_t* sink) {
+    sink->buffer_size = sink->period * sink->channels * (sink->width / 8);
 
-    tail_pcm_playback_init();
-    tail_pcm_capture_init();
+    tail_pcm_playback_init(sink);
 
-    cout << "Rate: " << defaultRate << endl;
-    cout << "Width: " << defaultWidth << endl;
-    cout << "Channels: " << defaultChannels << endl;
+    cout << "Sink: " << sink->name << " (" << sink->device << ")" << endl;
+    cout << "Rate: " << sink->rate << endl;
+    cout << "Width: " << sink->width << endl;
+    cout << "Channels: " << sink->channels << endl;
 }
 
-void tail_client_pause(int id) {
-    clients[id]->state = PAUSE;
+vector<string> tail_split(string str, char delim) {
+    vector<string> list;
+    size_t pos;
+
+    while ((pos = str.find(delim)) != string::npos) {
+        list.push_back(str.substr(0, pos));
+        str.erase(0, pos + 1);
+    }
+
+    list.push_back(str);
+    return list;
 }
 
-void tail_client_resume(int id) {
-    clients[id]->state = RUNNING;
+// "device[@rate[/width[/channels]]]", empty or missing values keep the ones passed in.
+// Only writes the result back if the whole spec is valid, returns the error reply otherwise.
+string tail_sink_format_parse(string spec, string& device, int& rate, int& width, int& channels) {
+    int new_rate = rate, new_width = width, new_channels = channels;
+    size_t pos = spec.rfind('@');
+
+    if (pos != string::npos) {
+        vector<string> format = tail_split(spec.substr(pos + 1), '/');
+        spec.erase(pos);
+
+        if (format.size() > 0 && !format[0].empty()) new_rate = atoi(format[0].c_str());
+        if (format.size() > 1 && !format[1].empty()) new_width = atoi(format[1].c_str());
+        if (format.size() > 2 && !format[2].empty()) new_channels = atoi(format[2].c_str());
+    }
+
+    // the mixer and converters only handle these, anything else would size buffers wrong or divide by zero
+    if (new_width != 16 && new_width != 32) return "Error: Unsupported sample width.";
+    if (new_rate < 8000 || new_rate > 384000) return "Error: Unsupported sample rate.";
+    if (new_channels < 1 || new_channels > CHMAP_MAX_CHANNELS) return "Error: Unsupported channel count.";
+
+    if (!spec.empty()) device = spec;
+
+    rate = new_rate;
+    width = new_width;
+    channels = new_channels;
+
+    return "";
+}
+
+// "name=device[@rate[/width[/channels]]]", missing values are taken from the command line defaults.
+// Returns nullptr for an invalid spec.
+tail_sink_t* tail_sink_parse(string spec) {
+    tail_sink_t* sink = new tail_sink_t;
+    sink->width = defaultWidth;
+    sink->rate = defaultRate;
+    sink->channels = defaultChannels;
+    sink->period = defaultPeriod;
+
+    size_t pos = spec.find('=');
+    sink->name = spec.substr(0, pos);
+
+    string error = tail_sink_format_parse((pos != string::npos) ? spec.substr(pos + 1) : spec, sink->device, sink->rate, sink->width, sink->channels);
+
+    if (!error.empty()) {
+        cout << "Sink " << sink->name << ": " << error << endl;
+
+        delete sink;
+        return nullptr;
+    }
+
+    return sink;
+}
+
+// An empty name selects the first sink
+tail_sink_t* tail_sink_find(string name) {
+    if (name.empty()) return sinks.front();
+
+    for (tail_sink_t* sink : sinks) if (sink->name == name) return sink;
+    return nullptr;
+}
+
+// Best effort, needs CAP_SYS_NICE or an rtprio limit
+void tail_thread_set_realtime(thread& t) {
+    sched_param param;
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+
+    pthread_setschedparam(t.native_handle(), SCHED_FIFO, &param);
+}
+
+size_t tail_client_frame_size(client_t* client) {
+    return client->header.numChannels * (client->header.bitsPerSample / 8);
+}
+
+// The caller holds the sink mutex for both
+void tail_sink_activate(tail_sink_t* sink, client_t* client) {
+    pair<int, client_t*> entry = {client->id, client};
+    auto it = lower_bound(sink->active.begin(), sink->active.end(), entry);
+
+    if (it == sink->active.end() || it->first != client->id) sink->active.insert(it, entry);
+}
+
+void tail_sink_deactivate(tail_sink_t* sink, client_t* client) {
+    auto it = lower_bound(sink->active.begin(), sink->active.end(), pair<int, client_t*>(client->id, nullptr));
+
+    if (it != sink->active.end() && it->first == client->id) sink->active.erase(it);
+}
+
+void tail_client_pause(tail_sink_t* sink, int id) {
+    lock_guard<mutex> lock(sink->mtx);
+
+    auto it = sink->clients.find(id);
+    if (it == sink->clients.end()) return;
+
+    client_t* client = it->second;
+
+    client->state = PAUSE;
+    client->frames_submitted = client->frames_mixed;
+    tail_sink_deactivate(sink, client);
+
+    // a paused stream never drains, let a waiting drain give up
+    if (client->draining) sink->drain_cv.notify_all();
 }
 
-void tail_client_close(int id) {
+void tail_client_resume(tail_sink_t* sink, int id) {
+    sink->mtx.lock();
+
+    auto it = sink->clients.find(id);
+    if (it == sink->clients.end()) {
+        sink->mtx.unlock();
+        return;
+    }
+
+    client_t* client = it->second;
+
+    client->state = RUNNING;
+    if (client->mode == PLAYBACK) tail_sink_activate(sink, client);
+
+    // the pause is not network jitter
+    client->buffer_mtx.lock();
+    client->jitter.reset();
+    client->buffer_mtx.unlock();
+
+    sink->mtx.unlock();
+
+    sink->wake.notify_all();
+}
+
+long tail_client_drift_callback(void* data, float** out) {
+    client_t* client = (client_t*)data;
+    size_t frame_size = tail_client_frame_size(client);
+
+    size_t snd_size = client->buffer.read(client->drift_raw, client->buffer_size / frame_size * frame_size);
+    size_t frames = snd_size / frame_size;
+
+    if (client->header.bitsPerSample == 32) src_int_to_float_array((int*)client->drift_raw, client->drift_in, frames * client->header.numChannels);
+    else src_short_to_float_array((short*)client->drift_raw, client->drift_in, frames * client->header.numChannels);
+
+    client->frames_mixed += frames;
+
+    *out = client->drift_in;
+    return frames;
+}
+
+void tail_client_drift_init(client_t* client) {
+    if (client->header.bitsPerSample != 16 && client->header.bitsPerSample != 32) return;
+
+    size_t samples = client->buffer_size / (client->header.bitsPerSample / 8);
+
+    int error;
+    client->drift_src = src_callback_new(tail_client_drift_callback, SRC_SINC_FASTEST, client->header.numChannels, &error, client);
+
+    if (!client->drift_src) {
+        cout << "Drift compensation error: " << src_strerror(error) << endl;
+        return;
+    }
+
+    client->drift_raw = new char[client->buffer_size];
+    client->drift_in = new float[samples];
+    client->drift_out = new float[samples];
+}
+
+void tail_client_drift_free(client_t* client) {
+    if (client->drift_src) src_delete(client->drift_src);
+
+    delete[] client->drift_raw;
+    delete[] client->drift_in;
+    delete[] client->drift_out;
+
+    client->drift_src = nullptr;
+    client->drift_raw = nullptr;
+    client->drift_in = nullptr;
+    client->drift_out = nullptr;
+}
+
+// Reads one period from the ring, stretched or squeezed by the estimated drift
+// so the fill level stays around the middle of the jitter buffer.
+size_t tail_client_drift_read(client_t* client, char* dest) {
+    size_t frame_size = tail_client_frame_size(client);
+
+    client->drift.update(client->buffer.usage(), client->target_fill + client->chunk_size / 2);
+
+    long frames = src_callback_read(client->drift_src, client->drift.ratio, client->buffer_size / frame_size, client->drift_out);
+    if (frames < 0) frames = 0;
+
+    if (client->header.bitsPerSample == 32) src_float_to_int_array(client->drift_out, (int*)dest, frames * client->header.numChannels);
+    else src_float_to_short_array(client->drift_out, (short*)dest, frames * client->header.numChannels);
+
+    return frames * frame_size;
+}
+
+// Stops the codec threads. They may sleep for a period, so this runs before the sink mutex is taken
+void tail_client_codec_stop(client_t* client) {
+    client->codec_stop = true;
+
+    if (client->decoder_thread.joinable()) client->decoder_thread.join();
+    if (client->encoder_thread.joinable()) client->encoder_thread.join();
+}
+
+// Releases everything a client owns, the caller holds the sink mutex and removes it from the map
+void tail_client_free(client_t* client) {
+    tail_client_codec_stop(client);
+
+    delete client->encoder;
+    delete client->encode_ring;
+    delete client->recorder;
+
+    if (!client->file) client->sock.close();
+    delete client->file;
+
+    tail_client_drift_free(client);
+    delete[] client->mix_buffer;
+    delete[] client->dsp.work;
+
+    delete client;
+}
+
+void tail_client_close(tail_sink_t* sink, int id) {
+    sink->mtx.lock();
+    auto it = sink->clients.find(id);
+    client_t* client = (it != sink->clients.end()) ? it->second : nullptr;
+    sink->mtx.unlock();
+
+    if (!client) return;
+
+    tail_client_codec_stop(client);
+
     // wait_pcm_mtx = true;
-    mgr_mtx.lock();
+    sink->mtx.lock();
     // wait_pcm_mtx = false;
 
-    clients[id]->sock.close();
+    tail_sink_deactivate(sink, client);
+
+    wav_writer_t* recorder = client->recorder;
+    client->recorder = nullptr;
 
-    delete clients[id];
-    clients.erase(id);
+    tail_client_free(client);
+    sink->clients.erase(id);
 
-    mgr_mtx.unlock();
+    sink->mtx.unlock();
+
+    // the recorder finishes its file outside the sink lock, its writer may sleep for 250 ms
+    delete recorder;
 }
 
-bool tail_check_all_pcm_not_running() {
-    for (auto i : clients) if (i.second->state == RUNNING) return false;
-    return true;
+tail_pcm_timing_t tail_pcm_get_timing(PCM& pcm) {
+    tail_pcm_timing_t timing;
+
+    try {
+        timing.delay = pcm.status(timing.tstamp);
+    } catch (int e) {}
+
+    return timing;
+}
+
+double tail_time_now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void tail_client_buffer_resize(client_t* client, size_t size) {
+    size = max(size, client->buffer.usage());
+    if (client->buffer.size() == size) return;
+
+    size_t usage = client->buffer.usage();
+    char* data = new char[usage];
+
+    client->buffer.read(data, usage);
+    client->buffer.resize(size);
+    client->buffer.write(data, usage);
+
+    delete[] data;
+}
+
+// Target fill is two periods plus four times the measured jitter, bounded by --latency-target
+// (one second when unset). The target moves with the jitter average on almost every arrival,
+// so the ring grows by at least half at a time and only shrinks, to twice the need, once it is
+// four times larger than needed. A resize copies the ring under the sink mutex.
+void tail_client_jitter_update(client_t* client) {
+    double byte_rate = (double)client->header.sampleRate * tail_client_frame_size(client);
+
+    size_t min_fill = client->buffer_size * 2;
+    size_t max_fill = byte_rate * ((latencyTarget) ? latencyTarget / 1000.0 : 1.0);
+
+    if (max_fill < min_fill) max_fill = min_fill;
+
+    client->target_fill = clamp(min_fill + (size_t)(client->jitter.jitter * 4 * byte_rate), min_fill, max_fill);
+
+    size_t ring = client->target_fill + client->chunk_size * 2;
+    size_t size = client->buffer.size();
+
+    if (size < ring) tail_client_buffer_resize(client, max(ring, size * 3 / 2));
+    else if (size > ring * 4) tail_client_buffer_resize(client, ring * 2);
 }
 
-size_t tail_snd_width_convert(const char* buf, char* dest, size_t size, int from, int to) {
-    if (from == 16 && to == 32) return convert_16_to_32(buf, dest, size, use_resample);
-    else if (from == 32 && to == 16) return convert_32_to_16(buf, dest, size, use_resample);
+// Called every period: takes the next message off the socket as soon as it is there,
+// and moves it into the ring (acking it) once the fill drops below the target.
+void tail_client_jitter_refill(client_t* client) {
+    double byte_rate = (double)client->header.sampleRate * tail_client_frame_size(client);
+
+    while (true) {
+        if (client->rx_pending.empty()) {
+            sockrecv_t snd_data = client->sock.recvmsg();
+
+            if (!snd_data.size) break;
+
+            client->rx_pending.assign(snd_data.buffer, snd_data.size);
+            client->jitter.arrival(tail_time_now(), snd_data.size / byte_rate);
+        }
+
+        if (client->buffer.usage() >= client->target_fill) {
+            client->rx_held = true;
+            break;
+        }
+
+        client->buffer.write(client->rx_pending.data(), min<size_t>(client->rx_pending.size(), client->buffer.size() - client->buffer.usage()));
+        client->rx_pending.clear();
+        client->sock.send(0);
+
+        if (client->rx_held) client->jitter.reset();
+        client->rx_held = false;
+    }
 
-    return size;
+    tail_client_jitter_update(client);
 }
 
-size_t tail_snd_convert_channels(const char* buf, char* dest, size_t size, int inch, int outch, int width) {
-    if (inch < outch && width == 16) return convert_mono_to_stereo(buf, dest, size);
-    else if (inch < outch && width == 32) return convert_mono_to_stereo32(buf, dest, size);
-    else if (inch > outch && width == 16) return convert_stereo_to_mono(buf, dest, size);
-    else if (inch > outch && width == 32) return convert_stereo_to_mono32(buf, dest, size);
-    return size;
+// Tops the ring up to the jitter target straight from the mapped file
+void tail_client_file_refill(client_t* client) {
+    size_t usage = client->buffer.usage();
+    if (usage >= client->target_fill) return;
+
+    size_t size = min(client->target_fill + client->chunk_size - usage, client->file->size - client->file_pos);
+
+    client->buffer.write(client->file->data + client->file_pos, size);
+    client->file_pos += size;
 }
 
-size_t tail_snd_resample_soxr(const char* buffer, char* dest, size_t size, double inputRate, double outputRate, int width) {
-    if (inputRate == outputRate) return size;
+// Sends converted audio to a capture client. Compressed streams are queued for the encoder thread,
+// a block is dropped if the encoder has fallen a whole ring behind.
+void tail_client_send(client_t* client, const char* buffer, size_t size) {
+    if (client->encode_ring) client->encode_ring->push(buffer, size);
+    else client->sock.sendmsg(buffer, size);
+}
 
-    size_t isamples = size / (width / 8);
+chrono::microseconds tail_client_period_time(client_t* client) {
+    return chrono::microseconds((int64_t)client->sink->period * 1000000 / client->sink->rate);
+}
 
-    double rateRatio = outputRate / inputRate;
-    size_t osamples = lrint(isamples * rateRatio);
+// Waits for the next compressed message, sleeping a period at a time while the socket is empty
+bool tail_client_codec_recv(client_t* client, string& data) {
+    while (!client->codec_stop) {
+        sockrecv_t snd_data = client->sock.recvmsg();
 
-    soxr_datatype_t spec = (width == 32) ? SOXR_INT32_I : SOXR_INT16_I;
-    soxr_io_spec_t iospec = soxr_io_spec(spec, spec);
-    soxr_quality_spec_t qualityspec = soxr_quality_spec(SOXR_MQ, 0);
+        if (snd_data.size) {
+            data.assign(snd_data.buffer, snd_data.size);
+            client->sock.send(0);
+            return true;
+        }
 
-    size_t idone, odone;
-    soxr_oneshot(inputRate, outputRate, 1, buffer, isamples, &idone, dest, osamples, &odone, &iospec, &qualityspec, nullptr);
+        this_thread::sleep_for(tail_client_period_time(client));
+    }
 
-    return odone * (defaultWidth / 8);
+    return false;
 }
 
-size_t tail_snd_resample_libsamplerate(const char* buffer, char* dest, size_t size, double inputRate, double outputRate) {
-    if (inputRate == outputRate) return size;
+// Writes decoded audio to the ring once the jitter buffer has room for it
+void tail_client_codec_write(client_t* client, const char* buffer, size_t size) {
+    double byte_rate = (double)client->header.sampleRate * tail_client_frame_size(client);
+    bool waited = false;
 
-    size_t isamples = size / sizeof(int16_t);
+    while (!client->codec_stop) {
+        client->buffer_mtx.lock();
 
-    double rateRatio = outputRate / inputRate;
-    size_t osamples = lrint(isamples * rateRatio);
+        if (client->buffer.usage() < client->target_fill + client->chunk_size) {
+            if (client->buffer.size() < client->buffer.usage() + size) tail_client_buffer_resize(client, client->buffer.usage() + size);
 
-    int16_t* ibuf = new int16_t[isamples];
-    int16_t* obuf = new int16_t[osamples];
-    float* ifbuf = new float[isamples];
-    float* ofbuf = new float[osamples];
+            // the decoder was held back by a full ring, so this arrival says nothing about the network
+            if (waited) client->jitter.reset();
 
-    memcpy(ibuf, buffer, size);
-    src_short_to_float_array(ibuf, ifbuf, isamples);
+            client->jitter.arrival(tail_time_now(), size / byte_rate);
+            client->buffer.write(buffer, size);
+            tail_client_jitter_update(client);
 
-    SRC_DATA data;
-    data.data_in = ifbuf;
-    data.input_frames = isamples;
-    data.data_out = ofbuf;
-    data.output_frames = osamples;
-    data.src_ratio = rateRatio;
+            client->buffer_mtx.unlock();
+            return;
+        }
 
-    int error = src_simple(&data, SRC_SINC_BEST_QUALITY, 1);
+        client->buffer_mtx.unlock();
+        waited = true;
 
-    if (error) cout << "Resample error: " << src_strerror << endl;
+        this_thread::sleep_for(tail_client_period_time(client));
+    }
+}
 
-    src_float_to_short_array(ofbuf, obuf, osamples);
-    memcpy(dest, obuf, data.output_frames_gen * sizeof(int16_t));
+// Encodes whatever the capture path queued, in whole frames, sleeping a period while the ring is empty.
+// On stop the rest of the ring is still encoded.
+void tail_client_encoder(client_t* client) {
+    size_t frame_size = tail_client_frame_size(client);
+    vector<char> pcm(client->encode_ring->capacity() / frame_size * frame_size);
 
-    delete[] ibuf;
-    delete[] obuf;
-    delete[] ifbuf;
-    delete[] ofbuf;
+    while (true) {
+        bool stopping = client->codec_stop;
+        size_t size = client->encode_ring->usage() / frame_size * frame_size;
 
-    return data.output_frames_gen * sizeof(int16_t);
+        if (size) client->encoder->encode(pcm.data(), client->encode_ring->read(pcm.data(), size));
+        else if (stopping) return;
+        else this_thread::sleep_for(tail_client_period_time(client));
+    }
 }
 
-void tail_snd_volume_convert(const char* buffer, char* dest, size_t size, int volume, int width) {
-    if (width == 32) volume_convert32(buffer, dest, size, volume);
-    else volume_convert(buffer, dest, size, volume);
+void tail_client_decoder(client_t* client) {
+    codec_decoder_t decoder(client->codec, client->header.sampleRate, client->header.numChannels, client->header.bitsPerSample);
+
+    decoder.read = [client](string& data) { return tail_client_codec_recv(client, data); };
+    decoder.write = [client](const char* buffer, size_t size) { tail_client_codec_write(client, buffer, size); };
+
+    decoder.run();
 }
 
-void tail_snd_mix(const char* buffer, const char* buffer2, char* dest, size_t size) {
-    if (defaultWidth == 32) sound_mix32(buffer, buffer2, dest, size);
-    else sound_mix(buffer, buffer2, dest, size);
+bool tail_sink_playback_active(tail_sink_t* sink) {
+    if (!sink->active.empty()) return true;
+    for (auto [_, client] : sink->clients) if (client->state == RUNNING && client->mode == CAPTURE_PB) return true;
+    return false;
 }
 
-size_t tail_snd_convert(tail_sound_convert_t data) {
-    size_t buffer_size = defaultBufferSize * (32.0f / defaultWidth) * (2 / defaultChannels);
+bool tail_sink_capture_active(tail_sink_t* sink) {
+    for (auto [_, client] : sink->clients) if (client->state == RUNNING && client->mode == CAPTURE) return true;
+    return false;
+}
 
-    if (use_resample) buffer_size *= (384000.0f / defaultRate);
+// Opens a device that is closed while idle, retrying every 100 ms if it is busy.
+// Gives up for a reconfiguration, which needs the thread parked, or once no client needs it anymore.
+void tail_sink_reopen(tail_sink_t* sink, PCM& pcm, bool (*active)(tail_sink_t*), void (*reopen)(tail_sink_t*)) {
+    while (!exit_flag && !sink->reconfigure && !pcm.opened()) {
+        sink->mtx.lock();
+        bool needed = active(sink);
+        sink->mtx.unlock();
 
-    char* buffer = new char[buffer_size];
+        if (!needed) return;
 
-    memset(buffer, 0, buffer_size);
-    memcpy(buffer, data.inbuf, data.inSize);
+        try { reopen(sink); }
+        catch (int e) {
+            pcm.pcm_exit();
+            cout << "Device error: " << snd_strerror(e) << endl;
 
-    size_t snd_size = data.inSize;
+            // the card may have been plugged in since the device list was cached
+            pcm.cardlist(true);
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+    }
+}
+
+// Stops the device once nothing has been running for --idle-timeout and sleeps until
+// a client connects or resumes. The wait re-checks every 100 ms so SIGINT is not missed.
+// With reopen the device is closed instead of stopped, so it is not held while unused,
+// and it starts out closed until the first client needs it.
+void tail_sink_idle(tail_sink_t* sink, PCM& pcm, bool (*active)(tail_sink_t*), chrono::steady_clock::time_point& last_active, void (*reopen)(tail_sink_t*) = nullptr) {
+    bool closed = reopen && !pcm.opened();
+
+    if (!idleTimeout && !closed) return;
 
-    snd_size = tail_snd_width_convert(buffer, buffer, snd_size, data.inWidth, data.outWidth);
-    snd_size = tail_snd_convert_channels(buffer, buffer, snd_size, data.inChannels, data.outChannels, data.outWidth);
+    auto now = chrono::steady_clock::now();
 
-    if (use_resample) {
-        if (LibSR && data.outWidth == 16) snd_size = tail_snd_resample_libsamplerate(buffer, buffer, snd_size, data.inRate, data.outRate);
-        else snd_size = tail_snd_resample_soxr(buffer, buffer, snd_size, data.inRate, data.outRate, data.outWidth);
+    // the client map and active list change under the sink mutex
+    unique_lock<mutex> lock(sink->mtx);
+
+    if (active(sink)) {
+        lock.unlock();
+
+        if (closed) tail_sink_reopen(sink, pcm, active, reopen);
+
+        last_active = now;
+        return;
     }
 
-    tail_snd_volume_convert(buffer, buffer, snd_size, data.volume, data.outWidth);
+    if (!closed && now - last_active < chrono::milliseconds(idleTimeout)) return;
+
+    lock.unlock();
 
-    memcpy(data.outbuf, buffer, snd_size);
+    if (reopen) pcm.pcm_exit();
+    else try { pcm.drop(); } catch (int e) {}
 
-    delete[] buffer;
+    lock.lock();
+    while (!exit_flag && !sink->reconfigure && !active(sink)) sink->wake.wait_for(lock, chrono::milliseconds(100));
+    lock.unlock();
 
-    return snd_size;
+    if (reopen) {
+        if (!sink->reconfigure) tail_sink_reopen(sink, pcm, active, reopen);
+    } else try { pcm.prepare(); } catch (int e) {}
+
+    last_active = chrono::steady_clock::now();
 }
 
-void tail_pcm_io_capture_pb_callback(const char* buffer, size_t snd_size, int id) {
-    size_t client_buffer_size = defaultBufferSize * (32.0f / defaultWidth) * (2 / defaultChannels);
+// Scratch size for one period of any client stream: up to 32 bit, CHMAP_MAX_CHANNELS, 384 kHz when resampling
+size_t tail_sink_client_buffer_size(tail_sink_t* sink) {
+    size_t buffer_size = sink->period * sizeof(int32_t) * max(sink->channels, CHMAP_MAX_CHANNELS);
+
+    if (use_resample) buffer_size *= (384000.0f / sink->rate);
+
+    return buffer_size;
+}
 
-    if (use_resample) client_buffer_size *= (384000.0f / defaultRate);
+void tail_pcm_io_capture_pb_callback(tail_sink_t* sink, const char* buffer, size_t snd_size, int id) {
+    size_t client_buffer_size = tail_sink_client_buffer_size(sink);
 
     char* client_capture_buffer = new char[client_buffer_size];
 
-    for (auto [_, client] : clients) {
+    for (auto [_, client] : sink->clients) {
         if (client->mode == CAPTURE_PB && client->capture_pb_id == id && client->state == RUNNING) {
             memset(client_capture_buffer, 0, client_buffer_size);
 
             tail_sound_convert_t convdata;
             convdata.inbuf = buffer;
             convdata.outbuf = client_capture_buffer;
-            convdata.inWidth = defaultWidth;
+            convdata.inWidth = sink->width;
             convdata.outWidth = client->header.bitsPerSample;
-            convdata.inChannels = defaultChannels;
+            convdata.inChannels = sink->channels;
             convdata.outChannels = client->header.numChannels;
-            convdata.inRate = defaultRate;
+            convdata.inRate = sink->rate;
             convdata.outRate = client->header.sampleRate;
             convdata.volume = client->volume;
+            convdata.chmap = &client->chmap;
             convdata.inSize = snd_size;
 
-            snd_size = tail_snd_convert(convdata);
+            size_t client_snd_size = tail_snd_convert(convdata);
 
-            client->sock.sendmsg(client_capture_buffer, snd_size);
+            tail_client_send(client, client_capture_buffer, client_snd_size);
+            client->frames_mixed += client_snd_size / tail_client_frame_size(client);
+            client->frames_submitted = client->frames_mixed;
         }
     }
 
     delete[] client_capture_buffer;
 }
 
-void tail_pcm_io_playback() {
-    size_t client_buffer_size = defaultBufferSize * (32.0f / defaultWidth) * (2 / defaultChannels);
+// (Re)builds everything of a playback client that depends on the sink format.
+// The ring and the chunk size the client was told at handshake are kept.
+void tail_client_playback_setup(client_t* client) {
+    tail_sink_t* sink = client->sink;
+    size_t client_buffer_size = tail_sink_client_buffer_size(sink);
+
+    lock_guard<mutex> lock(client->buffer_mtx);
+
+    client->buffer_size = sink->buffer_size * ((float)client->header.bitsPerSample / sink->width) * ((float)client->header.numChannels / sink->channels);
+
+    if (use_resample) client->buffer_size *= ((double)client->header.sampleRate / sink->rate);
+
+    if (!client->chunk_size) client->chunk_size = client->buffer_size * 4;
+    tail_client_jitter_update(client);
+
+    // a file has no remote clock to drift from
+    tail_client_drift_free(client);
+    if (drift_compensation && !client->file) tail_client_drift_init(client);
+
+    delete[] client->mix_buffer;
+    client->mix_buffer = new char[client_buffer_size];
+
+    delete[] client->dsp.work;
+    client->dsp.work_size = client_buffer_size / sizeof(int16_t);
+    client->dsp.work = new float[client->dsp.work_size];
+
+    for (biquad_t& band : client->dsp.eq) band.redesign(sink->rate);
+}
+
+// Master bus and stream recordings are written in the sink format
+wav_writer_t* tail_recorder_open(tail_sink_t* sink, string path) {
+    wav_writer_t* recorder = new wav_writer_t(path, sink->rate, sink->channels, sink->width, (size_t)recordSize << 20, recordTime);
+
+    if (!recorder->start()) {
+        cout << "Record error: Unable to open " << recorder->file << endl;
+
+        delete recorder;
+        return nullptr;
+    }
+
+    return recorder;
+}
+
+// Continues a recording that a reconfiguration detached, in a new file with the sink's new format.
+// id is the recording client, 0 for the master bus. Called without the sink lock, as the old
+// writer finishes its file first and may sleep for 250 ms.
+void tail_recorder_reopen(tail_sink_t* sink, int id, wav_writer_t* recorder) {
+    string path = recorder->path;
+
+    delete recorder;
+    recorder = tail_recorder_open(sink, path);
 
-    if (use_resample) client_buffer_size *= (384000.0f / defaultRate);
+    // the client may have closed, or started another recording, in the meantime
+    sink->mtx.lock();
+    auto it = sink->clients.find(id);
+    wav_writer_t** slot = (!id) ? &sink->recorder : (it != sink->clients.end()) ? &it->second->recorder : nullptr;
 
-    char* mixed_buffer = new char[defaultBufferSize];
-    char* mixed_buffer_drm = new char[defaultBufferSize];
-    char* client_playback_buffer = new char[client_buffer_size];
+    if (slot && !*slot) swap(*slot, recorder);
+    sink->mtx.unlock();
+
+    delete recorder;
+}
+
+// Reopens both devices with the requested format and rebuilds the per-client converters.
+// Falls back to the previous format if the device refuses the new one.
+// Called by the playback thread, waits for the capture thread to park first.
+bool tail_sink_reconfigure(tail_sink_t* sink) {
+    unique_lock<mutex> lock(sink->mtx);
+
+    while (!exit_flag && !sink->capture_parked) sink->wake.wait_for(lock, chrono::milliseconds(100));
+    if (exit_flag) return false;
+
+    string device = sink->device;
+    int rate = sink->rate, width = sink->width, channels = sink->channels;
+    bool capture = sink->capture.opened();
+
+    // validated by tail_client_reconfigure
+    tail_sink_format_parse(sink->reconfigure_spec, sink->device, sink->rate, sink->width, sink->channels);
+
+    // the device may already be lost, then the new one replaces it
+    if (sink->playback.opened()) try { sink->playback.drop(); } catch (int e) {}
+
+    try {
+        sink->playback.pcm_exit();
+        sink->capture.pcm_exit();
+        tail_pcm_init(sink);
+        if (capture) tail_pcm_capture_init(sink);
+        sink->ready = true;
+        sink->reconfigure_ok = true;
+    } catch (int e) {
+        cout << "Reconfigure error: " << snd_strerror(e) << endl;
+
+        sink->device = device;
+        sink->rate = rate;
+        sink->width = width;
+        sink->channels = channels;
+
+        sink->playback.pcm_exit();
+        sink->capture.pcm_exit();
+
+        // if the old format is gone too the playback thread goes back to tail_sink_open,
+        // the capture thread reopens on demand
+        try {
+            tail_pcm_init(sink);
+            sink->ready = true;
+        } catch (int e) {
+            sink->playback.pcm_exit();
+            sink->ready = false;
+        }
+
+        try { if (capture) tail_pcm_capture_init(sink); } catch (int e) { sink->capture.pcm_exit(); }
+
+        sink->reconfigure_ok = false;
+    }
+
+    // recordings are detached here and continued in the new format once the lock is released
+    vector<pair<int, wav_writer_t*>> recorders;
+
+    for (auto [id, client] : sink->clients) {
+        if (client->mode == PLAYBACK) {
+            client->chmap.build_wav_to_alsa(client->header.numChannels, sink->channels);
+            tail_client_playback_setup(client);
+        } else client->chmap.build_alsa_to_wav(sink->channels, client->header.numChannels);
+
+        if (client->recorder) recorders.push_back({id, client->recorder});
+        client->recorder = nullptr;
+    }
+
+    if (sink->recorder) recorders.push_back({0, sink->recorder});
+    sink->recorder = nullptr;
+
+    sink->playback_timing = {};
+    sink->capture_timing = {};
+
+    sink->reconfigure = false;
+    sink->wake.notify_all();
+
+    lock.unlock();
+
+    for (auto [id, recorder] : recorders) tail_recorder_reopen(sink, id, recorder);
+
+    return true;
+}
+
+// Parks the capture thread while the playback thread reconfigures the sink
+void tail_sink_capture_park(tail_sink_t* sink) {
+    unique_lock<mutex> lock(sink->mtx);
+
+    sink->capture_parked = true;
+    sink->wake.notify_all();
+
+    while (!exit_flag && sink->reconfigure) sink->wake.wait_for(lock, chrono::milliseconds(100));
+
+    sink->capture_parked = false;
+}
+
+// Called by the playback thread after each mix with the sink mutex held. A draining client is done
+// once its ring stayed empty for as long as the device delay measured when it ran dry.
+void tail_sink_drain_update(tail_sink_t* sink) {
+    bool notify = false;
+
+    for (auto [_, client] : sink->pool.jobs) {
+        if (!client->draining || client->drained) continue;
+
+        if (client->mix_size) {
+            client->drain_left = -1;
+            continue;
+        }
+
+        if (client->drain_left < 0) client->drain_left = sink->playback_timing.delay;
+        else client->drain_left -= sink->period;
+
+        if (client->drain_left <= 0) client->drained = notify = true;
+    }
+
+    if (notify) sink->drain_cv.notify_all();
+}
+
+// Blocks until the mixer has played out everything buffered for the client.
+// Returns false if the stream was paused (or the server stops) before that.
+bool tail_client_drain_wait(client_t* client) {
+    tail_sink_t* sink = client->sink;
+
+    if (client->mode != PLAYBACK) return true;
+
+    unique_lock<mutex> lock(sink->mtx);
+
+    client->draining = true;
+    client->drained = false;
+    client->drain_left = -1;
+
+    while (!exit_flag && client->state == RUNNING && !client->drained) sink->drain_cv.wait_for(lock, chrono::milliseconds(100));
+
+    client->draining = false;
+
+    return client->drained;
+}
+
+// Duck gain of every class for this period from the envelopes of the classes above it:
+// down to --duck-level within a few periods, back up over about a second.
+void tail_sink_duck_gains(tail_sink_t* sink, float* gains) {
+    float higher = 0;
+
+    for (int c = CLASS_COUNT - 1; c >= 0; c--) {
+        float target = (higher > 0.01f) ? duckLevel / 100.0f : 1;
+        float coef = (target < sink->class_gain[c]) ? 0.5f : 0.02f;
+
+        gains[c] = sink->class_gain[c] + (target - sink->class_gain[c]) * coef;
+        if (fabs(gains[c] - target) < 0.001f) gains[c] = target;
+
+        higher = max(higher, sink->class_envelope[c]);
+    }
+}
+
+// Peak envelope follower with instant attack and a 300 ms release
+void tail_sink_duck_update(tail_sink_t* sink, float* peaks, float* gains) {
+    float release = exp(-(double)sink->period / sink->rate / 0.3);
+
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        sink->class_envelope[c] = max(peaks[c], sink->class_envelope[c] * release);
+        sink->class_gain[c] = gains[c];
+    }
+}
+
+// Reads and converts one period of a playback client into its mix_buffer.
+// Runs on the mix workers, so it must only touch state owned by the client.
+void tail_client_mix_prepare(tail_sink_t* sink, client_t* client) {
+    size_t client_buffer_size = tail_sink_client_buffer_size(sink);
+
+    client->mix_size = 0;
+    memset(client->mix_buffer, 0, client_buffer_size);
+
+    unique_lock<mutex> lock(client->buffer_mtx);
+
+    if (client->file) tail_client_file_refill(client);
+    else if (client->codec == CODEC_PCM) tail_client_jitter_refill(client);
+
+    if (client->buffer.empty()) {
+        // a finished file source is removed by the playback thread after the mix
+        if (client->file) client->state = STOP;
+        else if (client->frames_mixed) {
+            client->underruns++;
+            client->jitter.underrun((double)sink->period / sink->rate);
+            tail_client_jitter_update(client);
+        }
 
+        return;
+    }
+
+    size_t snd_size;
+
+    if (client->drift_src) snd_size = tail_client_drift_read(client, client->mix_buffer);
+    else {
+        snd_size = client->buffer.read(client->mix_buffer, client->buffer_size);
+        client->frames_mixed += snd_size / tail_client_frame_size(client);
+    }
+
+    lock.unlock();
+
+    tail_sound_convert_t convdata;
+    convdata.inbuf = client->mix_buffer;
+    convdata.outbuf = client->mix_buffer;
+    convdata.inWidth = client->header.bitsPerSample;
+    convdata.outWidth = sink->width;
+    convdata.inChannels = client->header.numChannels;
+    convdata.outChannels = sink->channels;
+    convdata.inRate = client->header.sampleRate;
+    convdata.outRate = sink->rate;
+    convdata.volume = 100;
+    convdata.chmap = &client->chmap;
+    convdata.inSize = snd_size;
+
+    client->mix_size = tail_snd_convert(convdata);
+
+    lock.lock();
+    client->dsp.process(client->mix_buffer, client->mix_size, sink->width, sink->channels);
+}
+
+void tail_mix_pool_run(tail_sink_t* sink) {
+    tail_mix_pool_t& pool = sink->pool;
+
+    for (size_t i; (i = pool.next++) < pool.jobs.size();) tail_client_mix_prepare(sink, pool.jobs[i].second);
+}
+
+void tail_mix_pool_worker(tail_sink_t* sink) {
+    tail_mix_pool_t& pool = sink->pool;
+    uint64_t generation = 0;
+
+    while (true) {
+        unique_lock<mutex> lock(pool.mtx);
+        pool.cv.wait(lock, [&] { return pool.stop || pool.generation != generation; });
+
+        if (pool.stop) return;
+
+        generation = pool.generation;
+        lock.unlock();
+
+        tail_mix_pool_run(sink);
+
+        lock.lock();
+        if (!--pool.pending) pool.done_cv.notify_one();
+    }
+}
+
+void tail_mix_pool_init(tail_sink_t* sink) {
+    for (int i = 0; i < mixThreads; i++) {
+        sink->pool.workers.emplace_back(tail_mix_pool_worker, sink);
+        tail_thread_set_realtime(sink->pool.workers.back());
+    }
+}
+
+void tail_mix_pool_exit(tail_sink_t* sink) {
+    tail_mix_pool_t& pool = sink->pool;
+
+    pool.mtx.lock();
+    pool.stop = true;
+    pool.mtx.unlock();
+
+    pool.cv.notify_all();
+
+    for (thread& worker : pool.workers) worker.join();
+    pool.workers.clear();
+}
+
+// Prepares every job on the workers and the calling thread, returns when all are done
+void tail_mix_pool_dispatch(tail_sink_t* sink) {
+    tail_mix_pool_t& pool = sink->pool;
+
+    pool.next = 0;
+
+    if (pool.workers.empty()) return tail_mix_pool_run(sink);
+
+    pool.mtx.lock();
+    pool.pending = pool.workers.size();
+    pool.generation++;
+    pool.mtx.unlock();
+
+    pool.cv.notify_all();
+
+    tail_mix_pool_run(sink);
+
+    unique_lock<mutex> lock(pool.mtx);
+    pool.done_cv.wait(lock, [&] { return !pool.pending; });
+}
+
+// Opens the sink's playback device, retrying every second until it is available.
+// Returns early for a pending reconfiguration, which leaves the sink not ready until it succeeds.
+void tail_sink_open(tail_sink_t* sink) {
     while (!exit_flag) {
-        memset(mixed_buffer, 0, defaultBufferSize);
-        memset(mixed_buffer_drm, 0, defaultBufferSize);
-
-        if (!clients.empty() && !tail_check_all_pcm_not_running()) {
-            mgr_mtx.lock();
-
-            for (auto [id, client] : clients) {
-                if (client->state != RUNNING) continue;
-
-                if (client->mode == PLAYBACK) {
-                    memset(client_playback_buffer, 0, client_buffer_size);
-
-                    if (client->buffer.usage() < client->buffer.size() / 10) {
-                        while (client->buffer.usage() < client->buffer.size() / 2) {
-                            sockrecv_t snd_data = client->sock.recvmsg();
-
-                            if (!snd_data.size) break;
-
-                            client->buffer.write(snd_data.buffer, snd_data.size);
-                            client->sock.send(0);
-                        }
-                        
-                    }
-
-                    if (client->buffer.empty()) continue;
-
-                    size_t snd_size = client->buffer.read(client_playback_buffer, client->buffer_size);
-
-                    tail_sound_convert_t convdata;
-                    convdata.inbuf = client_playback_buffer;
-                    convdata.outbuf = client_playback_buffer;
-                    convdata.inWidth = client->header.bitsPerSample;
-                    convdata.outWidth = defaultWidth;
-                    convdata.inChannels = client->header.numChannels;
-                    convdata.outChannels = defaultChannels;
-                    convdata.inRate = client->header.sampleRate;
-                    convdata.outRate = defaultRate;
-                    convdata.volume = client->volume;
-                    convdata.inSize = snd_size;
-
-                    snd_size = tail_snd_convert(convdata);
-
-                    if (client->drm_playback) tail_snd_mix(mixed_buffer_drm, client_playback_buffer, mixed_buffer_drm, snd_size);
-                    else {
-                        tail_pcm_io_capture_pb_callback(client_playback_buffer, snd_size, id);
-                        tail_snd_mix(mixed_buffer, client_playback_buffer, mixed_buffer, snd_size);
-                    }
-                }
+        try {
+            tail_pcm_init(sink);
+            break;
+        } catch (int e) {
+            sink->playback.pcm_exit();
+            cout << "Sink " << sink->name << " error: " << snd_strerror(e) << endl;
+
+            // the card may have been plugged in since the device list was cached
+            sink->playback.cardlist(true);
+
+            unique_lock<mutex> lock(sink->mtx);
+            sink->open_failed = true;
+            sink->wake.notify_all();
+
+            // a reconfiguration may switch away from the dead device, the playback loop applies it
+            if (sink->wake.wait_for(lock, chrono::seconds(1), [sink] { return exit_flag || sink->reconfigure; })) return;
+        }
+    }
+
+    sink->mtx.lock();
+    sink->ready = !exit_flag;
+    sink->mtx.unlock();
+
+    sink->wake.notify_all();
+}
+
+// Closes a playback device that could not be reinitialized, the playback loop reopens it
+void tail_sink_lost(tail_sink_t* sink) {
+    sink->playback.pcm_exit();
+
+    sink->mtx.lock();
+    sink->ready = false;
+    sink->mtx.unlock();
+}
+
+// Waits until the playback thread has opened the sink. With first_attempt it gives up
+// as soon as one attempt has failed, so handshakes get an error instead of hanging.
+bool tail_sink_wait_ready(tail_sink_t* sink, bool first_attempt) {
+    unique_lock<mutex> lock(sink->mtx);
+
+    while (!exit_flag && !sink->ready && !(first_attempt && sink->open_failed)) sink->wake.wait_for(lock, chrono::milliseconds(100));
+
+    return sink->ready;
+}
+
+void tail_pcm_io_playback(tail_sink_t* sink) {
+    tail_sink_open(sink);
+    if (exit_flag) return;
+
+    char* mixed_buffer = new char[sink->buffer_size];
+    char* mixed_buffer_drm = new char[sink->buffer_size];
+
+    tail_pcm_timing_t timing;
+
+    auto last_active = chrono::steady_clock::now();
+
+    tail_mix_pool_init(sink);
+
+    while (!exit_flag) {
+        if (sink->reconfigure && tail_sink_reconfigure(sink)) {
+            delete[] mixed_buffer;
+            delete[] mixed_buffer_drm;
+
+            mixed_buffer = new char[sink->buffer_size];
+            mixed_buffer_drm = new char[sink->buffer_size];
+        }
+
+        // the device was lost (failed reinit or reconfigure fallback), handshakes wait meanwhile
+        if (!sink->playback.opened()) {
+            tail_sink_open(sink);
+            continue;
+        }
+
+        tail_sink_idle(sink, sink->playback, tail_sink_playback_active, last_active);
+
+        memset(mixed_buffer, 0, sink->buffer_size);
+        memset(mixed_buffer_drm, 0, sink->buffer_size);
+
+        sink->mtx.lock();
+
+        sink->playback_timing = timing;
+
+        if (!sink->active.empty()) {
+            // paused clients are not in the active list, the per-period cost only grows with running streams
+            sink->pool.jobs = sink->active;
+
+            for (auto [_, client] : sink->pool.jobs) client->frames_submitted = client->frames_mixed;
+
+            tail_mix_pool_dispatch(sink);
+
+            float peaks[CLASS_COUNT] = {};
+            float gains[CLASS_COUNT];
+
+            tail_sink_duck_gains(sink, gains);
+
+            // the reduction runs in client order, so the mix does not depend on the thread count.
+            // ducking and the class envelopes are applied and measured while mixing
+            for (auto [id, client] : sink->pool.jobs) {
+                if (!client->mix_size) continue;
+
+                int c = client->stream_class;
+                char* dest = (client->drm_playback) ? mixed_buffer_drm : mixed_buffer;
+
+                if (!client->drm_playback) tail_pcm_io_capture_pb_callback(sink, client->mix_buffer, client->mix_size, id);
+                if (client->recorder) client->recorder->push(client->mix_buffer, client->mix_size);
+
+                float peak = tail_snd_mix_gain(dest, client->mix_buffer, dest, client->mix_size, sink->width, sink->class_gain[c], gains[c]);
+                peaks[c] = max(peaks[c], peak);
             }
 
-            mgr_mtx.unlock();
+            tail_sink_duck_update(sink, peaks, gains);
+            tail_sink_drain_update(sink);
+
+            // file sources have no control connection, so they never hold a recorder that would block here
+            for (auto [id, client] : sink->pool.jobs) {
+                if (!client->file || client->state != STOP) continue;
+
+                tail_sink_deactivate(sink, client);
+                tail_client_free(client);
+                sink->clients.erase(id);
+            }
         }
 
-        tail_pcm_io_capture_pb_callback(mixed_buffer, defaultBufferSize, 0);
+        // master bus taps, still under the sink mutex
+        tail_pcm_io_capture_pb_callback(sink, mixed_buffer, sink->buffer_size, 0);
+        if (sink->recorder) sink->recorder->push(mixed_buffer, sink->buffer_size);
+
+        sink->mtx.unlock();
 
-        tail_snd_mix(mixed_buffer_drm, mixed_buffer, mixed_buffer, defaultBufferSize);
+        tail_snd_mix(mixed_buffer_drm, mixed_buffer, mixed_buffer, sink->buffer_size, sink->width);
         
-        try { pcm_playback.writei(mixed_buffer, defaultPeriod); } catch (int e) { tail_pcm_playback_reinit(); }
+        try {
+            sink->playback.writei(mixed_buffer, sink->period);
+            timing = tail_pcm_get_timing(sink->playback);
+        } catch (int e) {
+            try { tail_pcm_playback_reinit(sink); }
+            catch (int e) { tail_sink_lost(sink); }
+        }
     }
 
+    tail_mix_pool_exit(sink);
+
+    delete sink->recorder;
+    sink->recorder = nullptr;
+
     delete[] mixed_buffer;
     delete[] mixed_buffer_drm;
-    delete[] client_playback_buffer;
 
-    pcm_playback.drop();
-    pcm_playback.pcm_exit();
+    if (sink->playback.opened()) try { sink->playback.drop(); } catch (int e) {}
+    sink->playback.pcm_exit();
 }
 
-void tail_pcm_io_capture() {
-    size_t client_buffer_size = defaultBufferSize * (32.0f / defaultWidth) * (2 / defaultChannels);
+void tail_pcm_io_capture(tail_sink_t* sink) {
+    if (!tail_sink_wait_ready(sink, false)) return;
 
-    if (use_resample) client_buffer_size *= (384000.0f / defaultRate);
+    size_t client_buffer_size = tail_sink_client_buffer_size(sink);
 
-    char* capture_buffer = new char[defaultBufferSize];
+    char* capture_buffer = new char[sink->buffer_size];
     char* client_capture_buffer = new char[client_buffer_size];
 
+    tail_pcm_timing_t timing;
+
+    auto last_active = chrono::steady_clock::now();
+
     while (!exit_flag) {
-        memset(capture_buffer, 0, defaultBufferSize);
+        if (sink->reconfigure) {
+            tail_sink_capture_park(sink);
+
+            delete[] capture_buffer;
+            delete[] client_capture_buffer;
+
+            client_buffer_size = tail_sink_client_buffer_size(sink);
+            capture_buffer = new char[sink->buffer_size];
+            client_capture_buffer = new char[client_buffer_size];
+        }
+
+        tail_sink_idle(sink, sink->capture, tail_sink_capture_active, last_active, tail_pcm_capture_init);
 
-        try { pcm_capture.readi(capture_buffer, defaultPeriod); } catch (int e) { tail_pcm_capture_reinit(); }
+        if (!sink->capture.opened()) continue;
 
-        if (!clients.empty() && !tail_check_all_pcm_not_running()) {
-            mgr_mtx.lock();
+        memset(capture_buffer, 0, sink->buffer_size);
 
-            for (auto [id, client] : clients) {
-                if (client->state != RUNNING) continue;
+        try {
+            sink->capture.readi(capture_buffer, sink->period);
+            timing = tail_pcm_get_timing(sink->capture);
+        } catch (int e) {
+            // reopened on demand by tail_sink_idle
+            try { tail_pcm_capture_reinit(sink); }
+            catch (int e) { sink->capture.pcm_exit(); }
+        }
+
+        // the client map is only walked under the sink mutex, handshakes and closes change it
+        sink->mtx.lock();
+
+        sink->capture_timing = timing;
+
+        for (auto [id, client] : sink->clients) {
+            if (client->state != RUNNING) continue;
+            
+            if (client->mode == CAPTURE) {
+                memset(client_capture_buffer, 0, client_buffer_size);
                 
-                if (client->mode == CAPTURE) {
-                    memset(client_capture_buffer, 0, client_buffer_size);
-                    
-                    size_t snd_size = defaultBufferSize;
-
-                    tail_sound_convert_t convdata;
-                    convdata.inbuf = capture_buffer;
-                    convdata.outbuf = client_capture_buffer;
-                    convdata.inWidth = defaultWidth;
-                    convdata.outWidth = client->header.bitsPerSample;
-                    convdata.inChannels = defaultChannels;
-                    convdata.outChannels = client->header.numChannels;
-                    convdata.inRate = defaultRate;
-                    convdata.outRate = client->header.sampleRate;
-                    convdata.volume = client->volume;
-                    convdata.inSize = snd_size;
-
-                    snd_size = tail_snd_convert(convdata);
-
-                    client->sock.sendmsg(client_capture_buffer, snd_size);
-                }
+                size_t snd_size = sink->buffer_size;
+
+                tail_sound_convert_t convdata;
+                convdata.inbuf = capture_buffer;
+                convdata.outbuf = client_capture_buffer;
+                convdata.inWidth = sink->width;
+                convdata.outWidth = client->header.bitsPerSample;
+                convdata.inChannels = sink->channels;
+                convdata.outChannels = client->header.numChannels;
+                convdata.inRate = sink->rate;
+                convdata.outRate = client->header.sampleRate;
+                convdata.volume = client->volume;
+                convdata.chmap = &client->chmap;
+                convdata.inSize = snd_size;
+
+                snd_size = tail_snd_convert(convdata);
+
+                tail_client_send(client, client_capture_buffer, snd_size);
+                client->frames_mixed += snd_size / tail_client_frame_size(client);
+                client->frames_submitted = client->frames_mixed;
             }
+        }
 
-            mgr_mtx.unlock();
-        } 
+        sink->mtx.unlock();
     }
 
     delete[] capture_buffer;
     delete[] client_capture_buffer;
 
-    pcm_capture.pcm_exit();
+    sink->capture.pcm_exit();
+}
+
+// Reply: "<latency_us> <position_frames> <timestamp_ns>".
+// timestamp is CLOCK_MONOTONIC (clock_gettime), taken by the device with the delay, 0 before the device has run.
+// position is the frame of the client stream being played (or captured) at timestamp,
+// latency is the time a frame written now needs to reach the speaker (or a captured frame to reach the client).
+void tail_client_latency(Socket& sock, client_t* client) {
+    tail_sink_t* sink = client->sink;
+
+    sink->mtx.lock();
+
+    tail_pcm_timing_t timing = (client->mode == CAPTURE) ? sink->capture_timing : sink->playback_timing;
+    int rate = client->header.sampleRate;
+
+    int64_t delay = (int64_t)timing.delay * rate / sink->rate;
+    int64_t position = (int64_t)client->frames_submitted;
+    int64_t latency_us = 0;
+
+    if (client->mode == PLAYBACK) {
+        position -= delay;
+        client->buffer_mtx.lock();
+        latency_us = (client->buffer.usage() / tail_client_frame_size(client) + delay) * 1000000 / rate;
+        client->buffer_mtx.unlock();
+    } else if (client->mode == CAPTURE) {
+        position += delay;
+        latency_us = (delay + (int64_t)sink->period * rate / sink->rate) * 1000000 / rate;
+    }
+
+    if (position < 0) position = 0;
+
+    int64_t tstamp_ns = (int64_t)timing.tstamp.tv_sec * 1000000000 + timing.tstamp.tv_nsec;
+
+    sink->mtx.unlock();
+
+    sock.sendmsg(to_string(latency_us) + " " + to_string(position) + " " + to_string(tstamp_ns));
+}
+
+// "<gain>", linear, 1 is unity, at most 10 (+20 dB)
+void tail_client_set_gain(Socket& sock, client_t* client) {
+    float gain = min(max(0.0f, strtof(sock.recvmsg().string.c_str(), nullptr)), 10.0f);
+
+    client->buffer_mtx.lock();
+    client->dsp.gain_target = gain;
+    client->volume = lrint(gain * 100);
+    client->buffer_mtx.unlock();
+}
+
+// "<pan>", -1 is left, 1 is right
+void tail_client_set_pan(Socket& sock, client_t* client) {
+    float pan = strtof(sock.recvmsg().string.c_str(), nullptr);
+
+    // clamp passes NaN through
+    if (!isfinite(pan)) return;
+    pan = clamp(pan, -1.0f, 1.0f);
+
+    client->buffer_mtx.lock();
+    client->dsp.pan_target = pan;
+    client->buffer_mtx.unlock();
+}
+
+// "<band> <type> <frequency> <gain_db> <q>", type is a biquad_type_t, BIQUAD_OFF disables the band.
+// gain_db is limited to +-DSP_MAX_GAIN_DB.
+void tail_client_set_eq(Socket& sock, client_t* client) {
+    int band, type;
+    double freq = 1000, gain_db = 0, q = 0.707;
+
+    if (sscanf(sock.recvmsg().string.c_str(), "%d %d %lf %lf %lf", &band, &type, &freq, &gain_db, &q) < 2) return;
+    if (band < 0 || band >= DSP_MAX_BANDS || type < BIQUAD_OFF || type > BIQUAD_HIGHPASS) return;
+    if (!isfinite(freq) || !isfinite(gain_db) || !isfinite(q)) return;
+
+    client->buffer_mtx.lock();
+    client->dsp.eq[band].design((biquad_type_t)type, client->sink->rate, freq, gain_db, q);
+    client->buffer_mtx.unlock();
 }
 
+// "device[@rate[/width[/channels]]]" for the client's sink, empty fields keep their value.
+// Replies "OK" once the new format is playing, or an error if the old one had to be restored.
+void tail_client_reconfigure(Socket& sock, client_t* client) {
+    tail_sink_t* sink = client->sink;
+    string spec = sock.recvmsg().string;
+
+    unique_lock<mutex> lock(sink->mtx);
+
+    while (!exit_flag && sink->reconfigure) sink->wake.wait_for(lock, chrono::milliseconds(100));
+
+    // checked against the current format before the sink is touched
+    string device = sink->device;
+    int rate = sink->rate, width = sink->width, channels = sink->channels;
+    string error = tail_sink_format_parse(spec, device, rate, width, channels);
+
+    if (!error.empty()) {
+        lock.unlock();
+        sock.sendmsg(error);
+        return;
+    }
+
+    sink->reconfigure_spec = spec;
+    sink->reconfigure = true;
+    sink->wake.notify_all();
+
+    while (!exit_flag && sink->reconfigure) sink->wake.wait_for(lock, chrono::milliseconds(100));
+
+    bool ok = sink->reconfigure_ok;
+    lock.unlock();
+
+    sock.sendmsg(ok ? "OK" : "Error: Unsupported format or device.");
+}
+
+// Plays a WAV file on the sink without a client connection, returns its client id or 0
+int tail_file_source_start(tail_sink_t* sink, string path) {
+    if (!tail_sink_wait_ready(sink, false)) return 0;
+
+    wav_reader_t* file = new wav_reader_t;
+    wav_header_t header;
+
+    if (!file->open(path) || !tail_header_check((const char*)&file->header, sizeof(wav_header_t), header).empty()) {
+        cout << "Play error: Unsupported file " << path << endl;
+
+        delete file;
+        return 0;
+    }
+
+    client_t* client = new client_t;
+    client->sink = sink;
+    client->state = RUNNING;
+    client->header = file->header;
+    client->mode = PLAYBACK;
+    client->file = file;
+
+    client->chmap.build_wav_to_alsa(client->header.numChannels, sink->channels);
+
+    sink->mtx.lock();
+
+    tail_client_playback_setup(client);
+
+    int id = client->id = --fileSourceId;
+    sink->clients[id] = client;
+    tail_sink_activate(sink, client);
+
+    sink->mtx.unlock();
+
+    sink->wake.notify_all();
+
+    return id;
+}
+
+// "<path>" records the client's stream as mixed (sink format, before ducking), an empty path stops.
+// Replies "OK <file>", "OK" once stopped, or an error.
+void tail_client_record(Socket& sock, client_t* client, bool master) {
+    tail_sink_t* sink = client->sink;
+    string path = sock.recvmsg().string;
+
+    if (!master && (client->mode != PLAYBACK || client->drm_playback)) {
+        sock.sendmsg("Error: Only non DRM playback streams can be recorded.");
+        return;
+    }
+
+    wav_writer_t* recorder = (path.empty()) ? nullptr : tail_recorder_open(sink, path);
+
+    if (!path.empty() && !recorder) {
+        sock.sendmsg("Error: Unable to open file.");
+        return;
+    }
+
+    string reply = (recorder) ? "OK " + recorder->file : "OK";
+
+    sink->mtx.lock();
+    swap(recorder, (master) ? sink->recorder : client->recorder);
+    sink->mtx.unlock();
+
+    // the old recorder finishes its file outside the sink lock
+    delete recorder;
+
+    sock.sendmsg(reply);
+}
+
+// "<path>" plays a WAV file on the client's sink, replies the id of the new stream
+void tail_client_play_file(Socket& sock, client_t* client) {
+    int id = tail_file_source_start(client->sink, sock.recvmsg().string);
+
+    sock.sendmsg((id) ? to_string(id) : "Error: Unsupported file.");
+}
+
+// "<volume>" in percent like the handshake byte, ramped by the DSP chain, at most 1000
+void tail_client_set_volume(Socket& sock, client_t* client) {
+    int volume = clamp(atoi(sock.recvmsg().string.c_str()), 0, 1000);
+
+    client->buffer_mtx.lock();
+    client->dsp.gain_target = volume / 100.0f;
+    client->volume = volume;
+    client->buffer_mtx.unlock();
+}
+
+// Drops everything buffered for a playback client, the stream continues with the next data it sends
+void tail_client_flush(client_t* client) {
+    if (client->mode != PLAYBACK) return;
+
+    char discard[4096];
+
+    lock_guard<mutex> lock(client->buffer_mtx);
+
+    while (!client->buffer.empty()) client->buffer.read(discard, sizeof(discard));
+    if (client->drift_src) src_reset(client->drift_src);
+
+    // a held message is dropped too, the client is still waiting for its ack
+    if (!client->rx_pending.empty()) {
+        client->rx_pending.clear();
+        client->sock.send(0);
+    }
+
+    client->rx_held = false;
+    client->jitter.reset();
+}
+
+// Replies "OK" once everything buffered has reached the speaker, or an error if the stream is paused
+void tail_client_drain(Socket& sock, client_t* client) {
+    sock.sendmsg((tail_client_drain_wait(client)) ? "OK" : "Error: Stream is paused.");
+}
+
+// Reply: "state=<running|paused> buffered=<frames> target=<frames> mixed=<frames> underruns=<n> jitter_us=<us> volume=<percent>"
+void tail_client_stats(Socket& sock, client_t* client) {
+    tail_sink_t* sink = client->sink;
+    size_t frame_size = tail_client_frame_size(client);
+
+    sink->mtx.lock();
+    client->buffer_mtx.lock();
+
+    string stats = string("state=") + ((client->state == RUNNING) ? "running" : "paused") +
+        " buffered=" + to_string(client->buffer.usage() / frame_size) +
+        " target=" + to_string(client->target_fill / frame_size) +
+        " mixed=" + to_string(client->frames_mixed) +
+        " underruns=" + to_string(client->underruns) +
+        " jitter_us=" + to_string((int64_t)(client->jitter.jitter * 1000000)) +
+        " volume=" + to_string(client->volume);
+
+    client->buffer_mtx.unlock();
+    sink->mtx.unlock();
+
+    sock.sendmsg(stats);
+}
+
+// Serves control commands until the client asks to close (returns true) or disconnects (returns false).
+bool tail_client_control(Socket& sock, client_t* client) {
+    while (true) {
+        sockrecv_t cmd = sock.recv(1);
+
+        if (!cmd.size) return false;
+
+        switch (cmd.buffer[0]) {
+            case CMD_LATENCY: tail_client_latency(sock, client); break;
+            case CMD_SET_GAIN: tail_client_set_gain(sock, client); break;
+            case CMD_SET_PAN: tail_client_set_pan(sock, client); break;
+            case CMD_SET_EQ: tail_client_set_eq(sock, client); break;
+            case CMD_RECONFIGURE: tail_client_reconfigure(sock, client); break;
+            case CMD_RECORD: tail_client_record(sock, client, false); break;
+            case CMD_RECORD_MASTER: tail_client_record(sock, client, true); break;
+            case CMD_PLAY_FILE: tail_client_play_file(sock, client); break;
+            case CMD_PAUSE: tail_client_pause(client->sink, client->id); break;
+            case CMD_RESUME: tail_client_resume(client->sink, client->id); break;
+            case CMD_SET_VOLUME: tail_client_set_volume(sock, client); break;
+            case CMD_FLUSH: tail_client_flush(client); break;
+            case CMD_DRAIN: tail_client_drain(sock, client); break;
+            case CMD_STATS: tail_client_stats(sock, client); break;
+            default: return true;
+        }
+    }
+}
+
+// Reads the handshake from a client's control socket
+struct tail_socket_reader_t {
+    Socket& sock;
+
+    string msg() {
+        sockrecv_t data = sock.recvmsg();
+        return data.size ? string(data.buffer, data.size) : "";
+    }
+
+    int byte() {
+        return (unsigned char)sock.recvbyte();
+    }
+};
+
 void tail_pcm_io_manager(Socket sock, Socket sockd, int client_id) {
-    // wait_pcm_mtx = true;
-    mgr_mtx.lock();
-    // wait_pcm_mtx = false;
+    tail_socket_reader_t reader = {sock};
+    tail_handshake_t handshake;
+
+    // nothing from the handshake is used before it has been checked
+    string error = tail_handshake_parse(reader, handshake);
+    tail_sink_t* sink = tail_sink_find(handshake.sink);
+
+    if (!sink) error = "Error: Unknown sink.";
+
+    if (!error.empty()) {
+        sock.sendmsg(error);
+
+        sock.close();
+        sockd.close();
+        return;
+    }
+
+    if (!tail_sink_wait_ready(sink, true)) {
+        sock.sendmsg("Error: Sink device unavailable.");
+
+        sock.close();
+        sockd.close();
+        return;
+    }
 
     client_t* client = new client_t;
     client->sock = sockd;
     client->state = RUNNING;
-    client->header = *((wav_header_t*)sock.recvmsg().buffer);
-    client->mode = (tail_stream_mode_t)sock.recvbyte();
-    client->volume = sock.recvbyte();
+    client->sink = sink;
+    client->header = handshake.header;
+    client->mode = handshake.mode;
+    client->volume = handshake.volume;
+    client->codec = handshake.codec;
+
+    if (client->mode == PLAYBACK) client->chmap.build_wav_to_alsa(client->header.numChannels, sink->channels);
+    else client->chmap.build_alsa_to_wav(sink->channels, client->header.numChannels);
+
+    if (client->codec != CODEC_PCM && client->mode != PLAYBACK) {
+        client->encoder = new codec_encoder_t(client->codec, client->header.sampleRate, client->header.numChannels, client->header.bitsPerSample);
+        client->encoder->write = [client](const char* buffer, size_t size) { client->sock.sendmsg(buffer, size); };
+
+        if (!client->encoder->init()) {
+            sock.sendmsg("Error: Unable to create encoder.");
+
+            sock.close();
+            sockd.close();
+
+            delete client->encoder;
+            delete client;
+            return;
+        }
+    }
     
     if (client->mode == CAPTURE_PB) {
-        client->capture_pb_id = stoi(sock.recvmsg().string);
+        client->capture_pb_id = handshake.capture_pb_id;
+
+        sink->mtx.lock();
+        auto it = sink->clients.find(client->capture_pb_id);
 
-        if (client->capture_pb_id && clients[client->capture_pb_id]->drm_playback) {
-            sock.sendmsg("Error: Unable capture DRM stream.");
+        if (client->capture_pb_id && it == sink->clients.end()) error = "Error: Unknown stream.";
+        else if (client->capture_pb_id && it->second->drm_playback) error = "Error: Unable capture DRM stream.";
+        sink->mtx.unlock();
+
+        if (!error.empty()) {
+            sock.sendmsg(error);
 
             sock.close();
             sockd.close();
 
-            mgr_mtx.unlock();
-
+            delete client->encoder;
             delete client;
             return;
         }
     }
 
     if (client->mode == PLAYBACK) {
-        client->drm_playback = sock.recvbyte();
-        client->buffer_size = defaultBufferSize * ((float)client->header.bitsPerSample / defaultWidth) * ((float)client->header.numChannels / defaultChannels);
-        client->buffer.resize(client->buffer_size * 1024);
+        client->drm_playback = handshake.drm_playback;
+        client->stream_class = handshake.stream_class;
+        client->dsp.gain = client->dsp.gain_target = client->volume / 100.0f;
 
-        if (use_resample) {
-            client->buffer.resize(((float)client->header.numChannels / defaultChannels) * (client->header.bitsPerSample / 8) * client->header.sampleRate);
-            client->buffer_size *= ((double)client->header.sampleRate / defaultRate);
-        }
+        tail_client_playback_setup(client);
+    }
+
+    // one second of the client's stream, at least 64 KiB
+    if (client->encoder) client->encode_ring = new spsc_ring_t(max<size_t>(client->header.sampleRate * tail_client_frame_size(client), 1 << 16));
+
+    client->id = client_id;
 
-        sock.sendmsg(to_string(client->buffer.size() / 4));
+    // the id is the peer's data port, which clients on different hosts can share
+    sink->mtx.lock();
+    bool taken = sink->clients.count(client_id);
+
+    if (!taken) {
+        sink->clients[client_id] = client;
+        if (client->mode == PLAYBACK) tail_sink_activate(sink, client);
     }
+    sink->mtx.unlock();
+
+    if (taken) {
+        sock.sendmsg("Error: Stream id in use.");
+        sock.close();
 
-    clients[client_id] = client;
-    mgr_mtx.unlock();
+        tail_client_free(client);
+        return;
+    }
 
-    if (client->mode == PLAYBACK) { if (sock.recv(1).size) while (!client->buffer.empty()) continue; }
-    else sock.recvbyte();
+    if (client->mode == PLAYBACK) sock.sendmsg(to_string(client->chunk_size));
+
+    if (client->codec != CODEC_PCM && client->mode == PLAYBACK) client->decoder_thread = thread(tail_client_decoder, client);
+    if (client->encoder) client->encoder_thread = thread(tail_client_encoder, client);
+
+    sink->wake.notify_all();
+
+    // a close request plays out what is buffered first, a paused stream is dropped
+    if (tail_client_control(sock, client)) tail_client_drain_wait(client);
 
     sock.send(0);
-    tail_client_close(client_id);
+    tail_client_close(sink, client_id);
 }
 
 int main(int argc, char** argv) {
     ArgumentParser parser(argc, argv);
     parser.add_argument({.flag1 = "-D", .flag2 = "--device"});
+    parser.add_argument({.flag2 = "--sinks"});
     parser.add_argument({.flag1 = "-r", .flag2 = "--rate", .type = ANYINTEGER });
     parser.add_argument({.flag1 = "-w", .flag2 = "--width", .type = ANYINTEGER });
     parser.add_argument({.flag1 = "-a", .flag2 = "--use-alsa", .without_value = true});
     parser.add_argument({.flag1 = "-m", .flag2 = "--mono", .without_value = true});
     parser.add_argument({.flag2 = "--libsamplerate", .without_value = true});
     parser.add_argument({.flag2 = "--resample", .without_value = true});
+    parser.add_argument({.flag2 = "--latency-target", .type = ANYINTEGER });
+    parser.add_argument({.flag2 = "--drift-compensation", .without_value = true});
+    parser.add_argument({.flag2 = "--mix-threads", .type = ANYINTEGER });
+    parser.add_argument({.flag2 = "--idle-timeout", .type = ANYINTEGER });
+    parser.add_argument({.flag2 = "--duck-level", .type = ANYINTEGER });
+    parser.add_argument({.flag2 = "--record"});
+    parser.add_argument({.flag2 = "--record-size", .type = ANYINTEGER });
+    parser.add_argument({.flag2 = "--record-time", .type = ANYINTEGER });
+    parser.add_argument({.flag2 = "--play"});
     auto args = parser.parse();
 
     defaultDevice = (args["--device"].type != ANYNONE) ? args["--device"].str : (args["--use-alsa"].boolean) ? "plughw:0,0" : "pulse";
@@ -501,6 +1821,14 @@ int main(int argc, char** argv) {
 
     LibSR = args["--libsamplerate"].boolean;
     use_resample = args["--resample"].boolean;
+    drift_compensation = args["--drift-compensation"].boolean;
+
+    if (args["--latency-target"].type != ANYNONE) latencyTarget = args["--latency-target"].integer;
+    if (args["--mix-threads"].type != ANYNONE) mixThreads = args["--mix-threads"].integer;
+    if (args["--idle-timeout"].type != ANYNONE) idleTimeout = args["--idle-timeout"].integer;
+    if (args["--duck-level"].type != ANYNONE) duckLevel = clamp((int)args["--duck-level"].integer, 0, 100);
+    if (args["--record-size"].type != ANYNONE) recordSize = max(0, (int)args["--record-size"].integer);
+    if (args["--record-time"].type != ANYNONE) recordTime = max(0, (int)args["--record-time"].integer);
 
     if (args["--mono"].boolean) defaultChannels = 1;
 
@@ -518,22 +1846,49 @@ int main(int argc, char** argv) {
     sockmgr.bind("", 53765);
     sockmgr.listen(0);
 
+    // "name=device[@rate[/width[/channels]]];...", the first sink is the default one
+    if (args["--sinks"].type != ANYNONE) for (string spec : tail_split(args["--sinks"].str, ';')) sinks.push_back(tail_sink_parse(spec));
+    else sinks.push_back(tail_sink_parse("default=" + defaultDevice));
+
+    for (tail_sink_t* sink : sinks) if (!sink) return 1;
+
+    // the devices are opened by the sink threads, so clients are accepted right away
+    // and a slow or missing device does not hold up the other sinks
     // thread(tail_pcm_device_writer).detach();
-    tail_pcm_init();
+    for (tail_sink_t* sink : sinks) {
+        sink->playback_thread = thread(tail_pcm_io_playback, sink);
+        sink->capture_thread = thread(tail_pcm_io_capture, sink);
+
+        tail_thread_set_realtime(sink->playback_thread);
+        tail_thread_set_realtime(sink->capture_thread);
+    }
+
+    // the master bus of the default sink, --record-size (MiB) and --record-time (seconds) rotate the files
+    if (args["--record"].type != ANYNONE) {
+        wav_writer_t* recorder = tail_recorder_open(sinks[0], args["--record"].str);
+
+        sinks[0]->mtx.lock();
+        sinks[0]->recorder = recorder;
+        sinks[0]->mtx.unlock();
+    }
 
-    thread tail_pcm_io_playback_thread(tail_pcm_io_playback);
-    thread tail_pcm_io_capture_thread(tail_pcm_io_capture);
+    // "path;...", played once on the default sink
+    if (args["--play"].type != ANYNONE) thread([path = args["--play"].str] {
+        for (string file : tail_split(path, ';')) tail_file_source_start(sinks[0], file);
+    }).detach();
     
     // while (true) thread(manager, sock.saccept().first).detach();
 
     while (!exit_flag) {
         try {
             pair<Socket, sockaddress_t> plclient = sockpl.accept(); 
-            thread(tail_pcm_io_manager, sockmgr.accept().first, plclient.first, plclient.second.port).detach();
             plclient.first.setblocking(false);
+            thread(tail_pcm_io_manager, sockmgr.accept().first, plclient.first, plclient.second.port).detach();
         } catch (...) {}
     }
 
-    tail_pcm_io_playback_thread.join();
-    tail_pcm_io_capture_thread.join();
+    for (tail_sink_t* sink : sinks) {
+        sink->playback_thread.join();
+        sink->capture_thread.join();
+    }
 }
\ No newline at end of file
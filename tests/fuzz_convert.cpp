@@ -0,0 +1,55 @@
+// libFuzzer target for tail_snd_convert over arbitrary formats and sizes.
+// Input: 8 bytes of format selectors, the rest (at least one byte) is the sample data.
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "../utils/convert.hpp"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size <= 8) return 0;
+
+    uint32_t rate_in = 0, rate_out = 0;
+    memcpy(&rate_in, data + 2, 2);
+    memcpy(&rate_out, data + 4, 2);
+
+    tail_sound_convert_t convdata;
+    convdata.inWidth = (data[0] & 1) ? 32 : 16;
+    convdata.outWidth = (data[0] & 2) ? 32 : 16;
+    convdata.inChannels = data[1] % CHMAP_MAX_CHANNELS + 1;
+    convdata.outChannels = (data[1] >> 4) % CHMAP_MAX_CHANNELS + 1;
+
+    // the range tail_header_check and the sink spec accept
+    convdata.inRate = 8000 + rate_in * (384000 - 8000) / 0xffff;
+    convdata.outRate = 8000 + rate_out * (384000 - 8000) / 0xffff;
+    convdata.volume = (data[6] | (data[7] << 8)) % 1001;
+
+    use_resample = data[0] & 4;
+    LibSR = data[0] & 8;
+
+    // the server always converts through a channel map, in either direction
+    chmap_t chmap;
+    if (data[0] & 16) chmap.build_alsa_to_wav(convdata.inChannels, convdata.outChannels);
+    else chmap.build_wav_to_alsa(convdata.inChannels, convdata.outChannels);
+
+    convdata.chmap = &chmap;
+    convdata.inSize = size - 8;
+
+    // the input in its own allocation, so reads past inSize are caught
+    std::vector<char> in(data + 8, data + size);
+    convdata.inbuf = in.data();
+
+    // as large as the scratch buffer tail_snd_convert sizes for the same format
+    size_t frames = convdata.inSize / (convdata.inWidth / 8) / convdata.inChannels + 1;
+    size_t out_size = frames * sizeof(int32_t) * std::max(convdata.inChannels, convdata.outChannels);
+    if (use_resample) out_size *= ceil(std::max(1.0, (double)convdata.outRate / convdata.inRate));
+
+    std::vector<char> out(out_size);
+    convdata.outbuf = out.data();
+
+    size_t snd_size = tail_snd_convert(convdata);
+    if (snd_size > out_size) __builtin_trap();
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+// libFuzzer target for tail_handshake_parse, the handshake tail_pcm_io_manager reads before
+// a client is admitted. The input is the control stream: a message is a length byte followed
+// by its bytes, a byte past the end reads as 0 like a closed socket. Two bytes after the
+// handshake pick the sink format, the rest is the first chunk of audio, converted like the
+// playback path does.
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../utils/convert.hpp"
+#include "../utils/handshake.hpp"
+
+struct fuzz_reader_t {
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0;
+
+    int byte() {
+        return (pos < size) ? data[pos++] : 0;
+    }
+
+    std::string msg() {
+        size_t len = byte();
+        len = std::min(len, size - pos);
+
+        std::string buffer((const char*)data + pos, len);
+        pos += len;
+        return buffer;
+    }
+};
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    fuzz_reader_t reader = {data, size};
+    tail_handshake_t handshake;
+
+    if (!tail_handshake_parse(reader, handshake).empty()) return 0;
+
+    // the sink format is validated at startup, any accepted one will do
+    int sink_channels = reader.byte() % CHMAP_MAX_CHANNELS + 1;
+    int sink_width = (reader.byte() & 1) ? 32 : 16;
+    int sink_rate = 48000;
+
+    chmap_t chmap;
+    if (handshake.mode == PLAYBACK) chmap.build_wav_to_alsa(handshake.header.numChannels, sink_channels);
+    else chmap.build_alsa_to_wav(sink_channels, handshake.header.numChannels);
+
+    if (handshake.mode != PLAYBACK) return 0;
+
+    std::vector<char> in(data + reader.pos, data + size);
+    if (in.empty()) return 0;
+
+    tail_sound_convert_t convdata;
+    convdata.inbuf = in.data();
+    convdata.inWidth = handshake.header.bitsPerSample;
+    convdata.outWidth = sink_width;
+    convdata.inChannels = handshake.header.numChannels;
+    convdata.outChannels = sink_channels;
+    convdata.inRate = handshake.header.sampleRate;
+    convdata.outRate = sink_rate;
+    convdata.volume = handshake.volume;
+    convdata.chmap = &chmap;
+    convdata.inSize = in.size();
+
+    size_t frames = convdata.inSize / (convdata.inWidth / 8) / convdata.inChannels + 1;
+    std::vector<char> out(frames * sizeof(int32_t) * CHMAP_MAX_CHANNELS);
+    convdata.outbuf = out.data();
+
+    tail_snd_convert(convdata);
+
+    return 0;
+}
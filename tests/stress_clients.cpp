@@ -0,0 +1,135 @@
+// Connect/disconnect stress test: many threads open, drive and drop streams on a running server.
+// Meant for a server built with -fsanitize=thread or -fsanitize=address on the ALSA null device,
+// see the Makefile. Usage: stress_clients [threads] [iterations] [host]
+#include <iostream>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include "../cpplibs/ssocket.hpp"
+#include "../wavheader.hpp"
+#include "../utils/wavfile.hpp"
+#include "../utils/protocol.hpp"
+using namespace std;
+
+string host = "127.0.0.1";
+
+// the server pairs the n-th data connection with the n-th control connection
+mutex connect_mtx;
+
+atomic<int> admitted = 0;
+atomic<int> rejected = 0;
+atomic<int> failed = 0;
+
+void stress_stream(mt19937& rng) {
+    Socket sockd;
+    Socket sock;
+
+    sockd.open(AF_INET, SOCK_STREAM);
+    sock.open(AF_INET, SOCK_STREAM);
+
+    {
+        lock_guard<mutex> lock(connect_mtx);
+        sockd.connect(host, 53764);
+        sock.connect(host, 53765);
+    }
+
+    int mode = rng() % 3;
+    int width = (rng() % 2) ? 32 : 16;
+    int channels = rng() % 8 + 1;
+    int rates[] = {8000, 22050, 44100, 48000, 96000};
+
+    wav_header_t header = wav_header_make(rates[rng() % 5], channels, width, 0);
+
+    // every fourth stream sends a truncated or corrupted header
+    size_t header_size = sizeof(header);
+    if (rng() % 4 == 0) {
+        if (rng() % 2) header_size = rng() % sizeof(header);
+        else ((char*)&header)[rng() % sizeof(header)] ^= 1 << (rng() % 8);
+    }
+
+    sock.sendmsg((const char*)&header, header_size);
+    sock.send((char)mode);
+    sock.send((char)(rng() % 256));
+    sock.sendmsg("default");
+    sock.send((char)0);
+
+    if (mode == CAPTURE_PB) sock.sendmsg("0");
+
+    if (mode == PLAYBACK) {
+        sock.send((char)0);
+        sock.send((char)(rng() % CLASS_COUNT));
+
+        string reply = sock.recvmsg().string;
+        if (reply.rfind("Error", 0) == 0) {
+            rejected++;
+            sock.close();
+            sockd.close();
+            return;
+        }
+
+        admitted++;
+
+        vector<char> chunk(max(atoi(reply.c_str()), 1));
+        for (char& c : chunk) c = rng();
+
+        for (int n = rng() % 64; n > 0; n--) {
+            sockd.sendmsg(chunk.data(), chunk.size());
+
+            switch (rng() % 16) {
+                case 0: sock.send((char)CMD_PAUSE); break;
+                case 1: sock.send((char)CMD_RESUME); break;
+                case 2: sock.send((char)CMD_FLUSH); break;
+                case 3: sock.send((char)CMD_STATS); sock.recvmsg(); break;
+                default: break;
+            }
+        }
+    } else {
+        admitted++;
+
+        // read a few periods, the server may also have refused the stream
+        for (int n = rng() % 16; n > 0; n--) if (!sockd.recvmsg().size) break;
+    }
+
+    // half of the streams close politely, the rest just disconnect
+    if (rng() % 2) {
+        sock.send((char)CMD_CLOSE);
+        sock.recv(1);
+    }
+
+    if (rng() % 8 == 0) this_thread::sleep_for(chrono::milliseconds(rng() % 50));
+
+    sock.close();
+    sockd.close();
+}
+
+void stress_client(int seed, int iterations) {
+    mt19937 rng(seed);
+
+    // the server may drop a stream at any point, that is not a failure of the server
+    for (int i = 0; i < iterations; i++) {
+        try {
+            stress_stream(rng);
+        } catch (...) {
+            failed++;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int threads = (argc > 1) ? atoi(argv[1]) : 16;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 100;
+    if (argc > 3) host = argv[3];
+
+    vector<thread> clients;
+    for (int t = 0; t < threads; t++) clients.push_back(thread(stress_client, t + 1, iterations));
+    for (thread& client : clients) client.join();
+
+    cout << "admitted " << admitted << ", rejected " << rejected << ", dropped " << failed << endl;
+    return 0;
+}
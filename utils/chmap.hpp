@@ -0,0 +1,139 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <initializer_list>
+
+#define CHMAP_MAX_CHANNELS 8
+
+enum chmap_pos_t {
+    CH_FL,
+    CH_FR,
+    CH_FC,
+    CH_LFE,
+    CH_RL,
+    CH_RR,
+    CH_RC,
+    CH_SL,
+    CH_SR
+};
+
+// Channel order of interleaved WAV streams (WAVE_FORMAT_EXTENSIBLE default masks), used by clients
+const chmap_pos_t chmap_wav_layouts[CHMAP_MAX_CHANNELS][CHMAP_MAX_CHANNELS] = {
+    {CH_FC},
+    {CH_FL, CH_FR},
+    {CH_FL, CH_FR, CH_FC},
+    {CH_FL, CH_FR, CH_RL, CH_RR},
+    {CH_FL, CH_FR, CH_FC, CH_RL, CH_RR},
+    {CH_FL, CH_FR, CH_FC, CH_LFE, CH_RL, CH_RR},
+    {CH_FL, CH_FR, CH_FC, CH_LFE, CH_RC, CH_SL, CH_SR},
+    {CH_FL, CH_FR, CH_FC, CH_LFE, CH_RL, CH_RR, CH_SL, CH_SR}
+};
+
+// Channel order of the ALSA surround devices, used by sinks
+const chmap_pos_t chmap_alsa_layouts[CHMAP_MAX_CHANNELS][CHMAP_MAX_CHANNELS] = {
+    {CH_FC},
+    {CH_FL, CH_FR},
+    {CH_FL, CH_FR, CH_FC},
+    {CH_FL, CH_FR, CH_RL, CH_RR},
+    {CH_FL, CH_FR, CH_RL, CH_RR, CH_FC},
+    {CH_FL, CH_FR, CH_RL, CH_RR, CH_FC, CH_LFE},
+    {CH_FL, CH_FR, CH_RL, CH_RR, CH_FC, CH_LFE, CH_RC},
+    {CH_FL, CH_FR, CH_RL, CH_RR, CH_FC, CH_LFE, CH_SL, CH_SR}
+};
+
+// Up/down-mix matrix, out-major: matrix[out * inch + in]
+struct chmap_t {
+    int inch = 0;
+    int outch = 0;
+    bool identity = true;
+    float matrix[CHMAP_MAX_CHANNELS * CHMAP_MAX_CHANNELS] = {};
+
+    // Adds coef to every output channel in list, returns false if the output layout has none of them
+    bool route(const chmap_pos_t* out, int in, std::initializer_list<chmap_pos_t> list, float coef) {
+        bool found = false;
+
+        for (int o = 0; o < outch; o++) {
+            if (std::find(list.begin(), list.end(), out[o]) == list.end()) continue;
+
+            matrix[o * inch + in] += coef;
+            found = true;
+        }
+
+        return found;
+    }
+
+    // Missing positions fold into the nearest existing ones (ITU-R BS.775 style), LFE is dropped on downmix.
+    // Mono is copied to both sides like before, rows are normalized so the mix cannot clip.
+    void build(int inch, const chmap_pos_t* in, int outch, const chmap_pos_t* out) {
+        this->inch = inch;
+        this->outch = outch;
+        memset(matrix, 0, sizeof(matrix));
+
+        const float h = 0.7071f;
+
+        for (int i = 0; i < inch; i++) {
+            chmap_pos_t pos = in[i];
+
+            if (route(out, i, {pos}, 1)) continue;
+
+            switch (pos) {
+                case CH_FC: route(out, i, {CH_FL, CH_FR}, (inch == 1) ? 1 : h); break;
+                case CH_FL: case CH_FR: route(out, i, {CH_FC}, h); break;
+
+                case CH_RL: route(out, i, {CH_SL}, 1) || route(out, i, {CH_FL}, h) || route(out, i, {CH_FC}, h * h); break;
+                case CH_RR: route(out, i, {CH_SR}, 1) || route(out, i, {CH_FR}, h) || route(out, i, {CH_FC}, h * h); break;
+                case CH_SL: route(out, i, {CH_RL}, 1) || route(out, i, {CH_FL}, h) || route(out, i, {CH_FC}, h * h); break;
+                case CH_SR: route(out, i, {CH_RR}, 1) || route(out, i, {CH_FR}, h) || route(out, i, {CH_FC}, h * h); break;
+
+                case CH_RC: route(out, i, {CH_RL, CH_RR}, h) || route(out, i, {CH_SL, CH_SR}, h) || route(out, i, {CH_FL, CH_FR}, h * h) || route(out, i, {CH_FC}, h * h); break;
+
+                default: break;
+            }
+        }
+
+        for (int o = 0; o < outch; o++) {
+            float sum = 0;
+            for (int i = 0; i < inch; i++) sum += matrix[o * inch + i];
+
+            if (sum > 1) for (int i = 0; i < inch; i++) matrix[o * inch + i] /= sum;
+        }
+
+        identity = (inch == outch);
+        for (int o = 0; o < outch && identity; o++)
+            for (int i = 0; i < inch; i++) if (matrix[o * inch + i] != (o == i)) identity = false;
+    }
+
+    void build_wav_to_alsa(int inch, int outch) {
+        build(inch, chmap_wav_layouts[inch - 1], outch, chmap_alsa_layouts[outch - 1]);
+    }
+
+    void build_alsa_to_wav(int inch, int outch) {
+        build(inch, chmap_alsa_layouts[inch - 1], outch, chmap_wav_layouts[outch - 1]);
+    }
+
+    // Remaps interleaved samples in one pass, in and dest may not overlap
+    template <typename T>
+    size_t apply(const T* __restrict in, T* __restrict dest, size_t frames) {
+        // largest float below 2^31 for 32 bit, the float conversion would overflow otherwise
+        const float lo = std::numeric_limits<T>::min();
+        const float hi = (sizeof(T) == 4) ? 2147483520.0f : std::numeric_limits<T>::max();
+
+        for (size_t f = 0; f < frames; f++) {
+            const T* src = in + f * inch;
+            T* dst = dest + f * outch;
+
+            for (int o = 0; o < outch; o++) {
+                const float* row = matrix + o * inch;
+                float sum = 0;
+
+                for (int i = 0; i < inch; i++) sum += row[i] * src[i];
+
+                dst[o] = std::clamp(sum, lo, hi);
+            }
+        }
+
+        return frames * outch * sizeof(T);
+    }
+};
@@ -0,0 +1,231 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <opus/opus.h>
+#include <FLAC/stream_decoder.h>
+#include <FLAC/stream_encoder.h>
+
+enum codec_t {
+    CODEC_PCM,
+    CODEC_OPUS,
+    CODEC_FLAC
+};
+
+bool codec_supported(codec_t codec, int rate, int channels, int width) {
+    if (width != 16 && width != 32) return false;
+
+    switch (codec) {
+        case CODEC_PCM: return true;
+        case CODEC_OPUS: return (channels == 1 || channels == 2) && (rate == 8000 || rate == 12000 || rate == 16000 || rate == 24000 || rate == 48000);
+        case CODEC_FLAC: return channels >= 1 && channels <= 8 && rate > 0 && rate <= 655350;
+    }
+
+    return false;
+}
+
+// Pulls compressed data through read() (one Opus packet or any number of FLAC stream bytes per call,
+// false ends the stream) and hands interleaved PCM of the requested width to write().
+class codec_decoder_t {
+    codec_t codec;
+    int rate;
+    int channels;
+    int width;
+
+    std::string pending;
+    std::vector<char> pcm;
+
+    static FLAC__StreamDecoderReadStatus flac_read(const FLAC__StreamDecoder*, FLAC__byte buffer[], size_t* bytes, void* data) {
+        codec_decoder_t* self = (codec_decoder_t*)data;
+
+        if (self->pending.empty() && !self->read(self->pending)) {
+            *bytes = 0;
+            return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+        }
+
+        *bytes = std::min(*bytes, self->pending.size());
+        memcpy(buffer, self->pending.data(), *bytes);
+        self->pending.erase(0, *bytes);
+
+        return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+    }
+
+    static FLAC__StreamDecoderWriteStatus flac_write(const FLAC__StreamDecoder*, const FLAC__Frame* frame, const FLAC__int32* const buffer[], void* data) {
+        codec_decoder_t* self = (codec_decoder_t*)data;
+
+        int bps = frame->header.bits_per_sample;
+        int channels = std::min<int>(frame->header.channels, self->channels);
+        size_t frames = frame->header.blocksize;
+
+        self->pcm.assign(frames * self->channels * (self->width / 8), 0);
+
+        for (size_t i = 0; i < frames; i++) {
+            for (int ch = 0; ch < channels; ch++) {
+                int64_t sample = (int64_t)buffer[ch][i] << 32 >> bps;
+                size_t pos = i * self->channels + ch;
+
+                if (self->width == 32) ((int32_t*)self->pcm.data())[pos] = sample;
+                else ((int16_t*)self->pcm.data())[pos] = sample >> 16;
+            }
+        }
+
+        self->write(self->pcm.data(), self->pcm.size());
+        return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+
+    static void flac_error(const FLAC__StreamDecoder*, FLAC__StreamDecoderErrorStatus, void*) {}
+
+    void run_opus() {
+        int error;
+        OpusDecoder* decoder = opus_decoder_create(rate, channels, &error);
+        if (error != OPUS_OK) return;
+
+        // 120 ms is the longest Opus packet
+        int max_frames = rate * 120 / 1000;
+        std::vector<float> fpcm(max_frames * channels);
+        pcm.resize(max_frames * channels * (width / 8));
+
+        std::string packet;
+
+        while (read(packet)) {
+            int frames;
+
+            if (width == 32) {
+                frames = opus_decode_float(decoder, (const unsigned char*)packet.data(), packet.size(), fpcm.data(), max_frames, 0);
+                for (int i = 0; i < frames * channels; i++) ((int32_t*)pcm.data())[i] = std::clamp(fpcm[i], -1.0f, 1.0f) * 2147483647.0;
+            } else frames = opus_decode(decoder, (const unsigned char*)packet.data(), packet.size(), (opus_int16*)pcm.data(), max_frames, 0);
+
+            if (frames > 0) write(pcm.data(), frames * channels * (width / 8));
+        }
+
+        opus_decoder_destroy(decoder);
+    }
+
+    void run_flac() {
+        FLAC__StreamDecoder* decoder = FLAC__stream_decoder_new();
+        if (!decoder) return;
+
+        if (FLAC__stream_decoder_init_stream(decoder, flac_read, nullptr, nullptr, nullptr, nullptr, flac_write, nullptr, flac_error, this) == FLAC__STREAM_DECODER_INIT_STATUS_OK)
+        FLAC__stream_decoder_process_until_end_of_stream(decoder);
+
+        FLAC__stream_decoder_delete(decoder);
+    }
+
+    public:
+    std::function<bool(std::string&)> read;
+    std::function<void(const char*, size_t)> write;
+
+    codec_decoder_t(codec_t codec, int rate, int channels, int width) : codec(codec), rate(rate), channels(channels), width(width) {}
+
+    void run() {
+        if (codec == CODEC_OPUS) run_opus();
+        else if (codec == CODEC_FLAC) run_flac();
+    }
+};
+
+// Takes interleaved PCM of any size through encode() and emits Opus packets (10 ms each)
+// or FLAC stream bytes through write().
+class codec_encoder_t {
+    codec_t codec;
+    int rate;
+    int channels;
+    int width;
+
+    OpusEncoder* opus = nullptr;
+    FLAC__StreamEncoder* flac = nullptr;
+
+    std::string pending;
+    std::vector<unsigned char> packet;
+    std::vector<float> fpcm;
+    std::vector<FLAC__int32> ipcm;
+
+    static FLAC__StreamEncoderWriteStatus flac_write(const FLAC__StreamEncoder*, const FLAC__byte buffer[], size_t bytes, uint32_t, uint32_t, void* data) {
+        ((codec_encoder_t*)data)->write((const char*)buffer, bytes);
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+    }
+
+    void encode_opus(const char* buffer, size_t size) {
+        size_t frames = rate / 100;
+        size_t frame_size = frames * channels * (width / 8);
+
+        pending.append(buffer, size);
+
+        size_t pos = 0;
+
+        for (; pending.size() - pos >= frame_size; pos += frame_size) {
+            int len;
+
+            if (width == 32) {
+                const int32_t* samples = (const int32_t*)(pending.data() + pos);
+                for (size_t i = 0; i < frames * channels; i++) fpcm[i] = samples[i] / 2147483648.0f;
+
+                len = opus_encode_float(opus, fpcm.data(), frames, packet.data(), packet.size());
+            } else len = opus_encode(opus, (const opus_int16*)(pending.data() + pos), frames, packet.data(), packet.size());
+
+            if (len > 0) write((const char*)packet.data(), len);
+        }
+
+        pending.erase(0, pos);
+    }
+
+    // FLAC streams are limited to 24 bit, 32 bit input loses its lowest byte
+    void encode_flac(const char* buffer, size_t size) {
+        size_t samples = size / (width / 8);
+        ipcm.resize(samples);
+
+        for (size_t i = 0; i < samples; i++) {
+            if (width == 32) ipcm[i] = ((const int32_t*)buffer)[i] >> 8;
+            else ipcm[i] = ((const int16_t*)buffer)[i];
+        }
+
+        FLAC__stream_encoder_process_interleaved(flac, ipcm.data(), samples / channels);
+    }
+
+    public:
+    std::function<void(const char*, size_t)> write;
+
+    codec_encoder_t(codec_t codec, int rate, int channels, int width) : codec(codec), rate(rate), channels(channels), width(width) {}
+
+    ~codec_encoder_t() {
+        if (opus) opus_encoder_destroy(opus);
+
+        if (flac) {
+            FLAC__stream_encoder_finish(flac);
+            FLAC__stream_encoder_delete(flac);
+        }
+    }
+
+    bool init() {
+        if (codec == CODEC_OPUS) {
+            int error;
+            opus = opus_encoder_create(rate, channels, OPUS_APPLICATION_AUDIO, &error);
+            if (error != OPUS_OK) return false;
+
+            packet.resize(4000);
+            fpcm.resize(rate / 100 * channels);
+            return true;
+        }
+
+        if (codec == CODEC_FLAC) {
+            if (!(flac = FLAC__stream_encoder_new())) return false;
+
+            FLAC__stream_encoder_set_channels(flac, channels);
+            FLAC__stream_encoder_set_bits_per_sample(flac, (width == 32) ? 24 : 16);
+            FLAC__stream_encoder_set_sample_rate(flac, rate);
+            FLAC__stream_encoder_set_compression_level(flac, 0);
+            FLAC__stream_encoder_set_blocksize(flac, 1152);
+
+            return FLAC__stream_encoder_init_stream(flac, flac_write, nullptr, nullptr, nullptr, this) == FLAC__STREAM_ENCODER_INIT_STATUS_OK;
+        }
+
+        return false;
+    }
+
+    void encode(const char* buffer, size_t size) {
+        if (opus) encode_opus(buffer, size);
+        else if (flac) encode_flac(buffer, size);
+    }
+};
@@ -0,0 +1,163 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <samplerate.h>
+#include <soxr.h>
+#include "../wavheader.hpp"
+#include "sndutils.hpp"
+#include "chmap.hpp"
+
+// Format conversion shared by the server and the fuzz targets in tests/,
+// nothing here touches sockets, sinks or devices.
+
+// set from --libsamplerate and --resample
+bool LibSR = false;
+bool use_resample = false;
+
+struct tail_sound_convert_t {
+    const char* inbuf;
+    char* outbuf;
+    int inWidth;
+    int outWidth;
+    int inChannels;
+    int outChannels;
+    int inRate;
+    int outRate;
+    int volume;
+    chmap_t* chmap = nullptr;
+    size_t inSize;
+};
+
+size_t tail_snd_width_convert(const char* buf, char* dest, size_t size, int from, int to) {
+    if (from == 16 && to == 32) return convert_16_to_32(buf, dest, size, use_resample);
+    else if (from == 32 && to == 16) return convert_32_to_16(buf, dest, size, use_resample);
+
+    return size;
+}
+
+size_t tail_snd_convert_channels(const char* buf, char* dest, size_t size, int inch, int outch, int width, chmap_t* chmap) {
+    if (chmap) {
+        if (chmap->identity) return size;
+
+        size_t frames = size / (width / 8) / inch;
+        char* inbuf = new char[size];
+
+        memcpy(inbuf, buf, size);
+
+        if (width == 32) size = chmap->apply((const int32_t*)inbuf, (int32_t*)dest, frames);
+        else size = chmap->apply((const int16_t*)inbuf, (int16_t*)dest, frames);
+
+        delete[] inbuf;
+        return size;
+    }
+
+    if (inch < outch && width == 16) return convert_mono_to_stereo(buf, dest, size);
+    else if (inch < outch && width == 32) return convert_mono_to_stereo32(buf, dest, size);
+    else if (inch > outch && width == 16) return convert_stereo_to_mono(buf, dest, size);
+    else if (inch > outch && width == 32) return convert_stereo_to_mono32(buf, dest, size);
+    return size;
+}
+
+size_t tail_snd_resample_soxr(const char* buffer, char* dest, size_t size, double inputRate, double outputRate, int width) {
+    if (inputRate == outputRate) return size;
+
+    size_t isamples = size / (width / 8);
+
+    double rateRatio = outputRate / inputRate;
+    size_t osamples = lrint(isamples * rateRatio);
+
+    soxr_datatype_t spec = (width == 32) ? SOXR_INT32_I : SOXR_INT16_I;
+    soxr_io_spec_t iospec = soxr_io_spec(spec, spec);
+    soxr_quality_spec_t qualityspec = soxr_quality_spec(SOXR_MQ, 0);
+
+    size_t idone, odone;
+    soxr_oneshot(inputRate, outputRate, 1, buffer, isamples, &idone, dest, osamples, &odone, &iospec, &qualityspec, nullptr);
+
+    return odone * (width / 8);
+}
+
+size_t tail_snd_resample_libsamplerate(const char* buffer, char* dest, size_t size, double inputRate, double outputRate) {
+    if (inputRate == outputRate) return size;
+
+    size_t isamples = size / sizeof(int16_t);
+
+    double rateRatio = outputRate / inputRate;
+    size_t osamples = lrint(isamples * rateRatio);
+
+    int16_t* ibuf = new int16_t[isamples];
+    int16_t* obuf = new int16_t[osamples];
+    float* ifbuf = new float[isamples];
+    float* ofbuf = new float[osamples];
+
+    memcpy(ibuf, buffer, isamples * sizeof(int16_t));
+    src_short_to_float_array(ibuf, ifbuf, isamples);
+
+    SRC_DATA data;
+    data.data_in = ifbuf;
+    data.input_frames = isamples;
+    data.data_out = ofbuf;
+    data.output_frames = osamples;
+    data.src_ratio = rateRatio;
+
+    int error = src_simple(&data, SRC_SINC_BEST_QUALITY, 1);
+
+    if (error) std::cout << "Resample error: " << src_strerror(error) << std::endl;
+
+    src_float_to_short_array(ofbuf, obuf, osamples);
+    memcpy(dest, obuf, data.output_frames_gen * sizeof(int16_t));
+
+    delete[] ibuf;
+    delete[] obuf;
+    delete[] ifbuf;
+    delete[] ofbuf;
+
+    return data.output_frames_gen * sizeof(int16_t);
+}
+
+void tail_snd_volume_convert(const char* buffer, char* dest, size_t size, int volume, int width) {
+    if (width == 32) volume_convert32(buffer, dest, size, volume);
+    else volume_convert(buffer, dest, size, volume);
+}
+
+float tail_snd_mix_gain(const char* buffer, const char* buffer2, char* dest, size_t size, int width, float gain, float gain_end) {
+    if (width == 32) return sound_mix_gain32(buffer, buffer2, dest, size, gain, gain_end);
+    else return sound_mix_gain(buffer, buffer2, dest, size, gain, gain_end);
+}
+
+void tail_snd_mix(const char* buffer, const char* buffer2, char* dest, size_t size, int width) {
+    if (width == 32) sound_mix32(buffer, buffer2, dest, size);
+    else sound_mix(buffer, buffer2, dest, size);
+}
+
+size_t tail_snd_convert(tail_sound_convert_t data) {
+    size_t frames = data.inSize / (data.inWidth / 8) / data.inChannels + 1;
+    size_t buffer_size = frames * sizeof(int32_t) * std::max(data.inChannels, data.outChannels);
+
+    if (use_resample) buffer_size *= ceil(std::max(1.0, (double)data.outRate / data.inRate));
+
+    char* buffer = new char[buffer_size];
+
+    memset(buffer, 0, buffer_size);
+    memcpy(buffer, data.inbuf, data.inSize);
+
+    size_t snd_size = data.inSize;
+
+    snd_size = tail_snd_width_convert(buffer, buffer, snd_size, data.inWidth, data.outWidth);
+    snd_size = tail_snd_convert_channels(buffer, buffer, snd_size, data.inChannels, data.outChannels, data.outWidth, data.chmap);
+
+    if (use_resample) {
+        if (LibSR && data.outWidth == 16) snd_size = tail_snd_resample_libsamplerate(buffer, buffer, snd_size, data.inRate, data.outRate);
+        else snd_size = tail_snd_resample_soxr(buffer, buffer, snd_size, data.inRate, data.outRate, data.outWidth);
+    }
+
+    tail_snd_volume_convert(buffer, buffer, snd_size, data.volume, data.outWidth);
+
+    memcpy(data.outbuf, buffer, snd_size);
+
+    delete[] buffer;
+
+    return snd_size;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <algorithm>
+
+// Estimates the clock drift between a remote stream and the device from the trend
+// of the buffer fill level and turns it into a resampling ratio (output frames per input frame).
+// The fill level is low-pass filtered over a few hundred periods so refill bursts and jitter
+// do not reach the ratio, and the correction is kept within max_correction.
+struct drift_estimator_t {
+    double fill = -1;
+    double integral = 0;
+    double ratio = 1;
+
+    static constexpr double smoothing = 1.0 / 256;
+    static constexpr double kp = 0.0005;
+    static constexpr double ki = 0.00002;
+    static constexpr double max_correction = 0.002;
+
+    double update(double usage, double target) {
+        if (fill < 0) fill = usage;
+        fill += (usage - fill) * smoothing;
+
+        double error = (target > 0) ? (fill - target) / target : 0;
+        integral = std::clamp(integral + error, -max_correction / ki, max_correction / ki);
+
+        ratio = 1 - std::clamp(kp * error + ki * integral, -max_correction, max_correction);
+        return ratio;
+    }
+};
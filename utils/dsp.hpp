@@ -0,0 +1,170 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#define DSP_MAX_BANDS 4
+#define DSP_MAX_CHANNELS 8
+#define DSP_MAX_GAIN_DB 24.0
+
+enum biquad_type_t {
+    BIQUAD_OFF,
+    BIQUAD_PEAK,
+    BIQUAD_LOWSHELF,
+    BIQUAD_HIGHSHELF,
+    BIQUAD_LOWPASS,
+    BIQUAD_HIGHPASS
+};
+
+// Transposed direct form II, coefficients from the RBJ audio EQ cookbook
+struct biquad_t {
+    biquad_type_t type = BIQUAD_OFF;
+    double freq = 1000, gain_db = 0, q = 0.707;
+    float b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+    float z1[DSP_MAX_CHANNELS] = {};
+    float z2[DSP_MAX_CHANNELS] = {};
+
+    void design(biquad_type_t type, double rate, double freq, double gain_db, double q) {
+        // NaN or inf would leave NaN in the filter state for good, such a band is switched off
+        if (!std::isfinite(freq) || !std::isfinite(gain_db) || !std::isfinite(q)) type = BIQUAD_OFF;
+
+        this->type = type;
+        this->freq = freq;
+        this->gain_db = gain_db = std::clamp(gain_db, -DSP_MAX_GAIN_DB, DSP_MAX_GAIN_DB);
+        this->q = q;
+
+        if (type == BIQUAD_OFF) return;
+
+        double A = pow(10, gain_db / 40);
+        double w0 = 2 * M_PI * std::clamp(freq, 1.0, rate / 2 - 1) / rate;
+        double alpha = sin(w0) / (2 * std::max(q, 0.01));
+        double cw = cos(w0);
+        double sA = 2 * sqrt(A) * alpha;
+
+        double nb0, nb1, nb2, na0, na1, na2;
+
+        switch (type) {
+            case BIQUAD_PEAK:
+                nb0 = 1 + alpha * A; nb1 = -2 * cw; nb2 = 1 - alpha * A;
+                na0 = 1 + alpha / A; na1 = -2 * cw; na2 = 1 - alpha / A;
+                break;
+
+            case BIQUAD_LOWSHELF:
+                nb0 = A * ((A + 1) - (A - 1) * cw + sA); nb1 = 2 * A * ((A - 1) - (A + 1) * cw); nb2 = A * ((A + 1) - (A - 1) * cw - sA);
+                na0 = (A + 1) + (A - 1) * cw + sA; na1 = -2 * ((A - 1) + (A + 1) * cw); na2 = (A + 1) + (A - 1) * cw - sA;
+                break;
+
+            case BIQUAD_HIGHSHELF:
+                nb0 = A * ((A + 1) + (A - 1) * cw + sA); nb1 = -2 * A * ((A - 1) + (A + 1) * cw); nb2 = A * ((A + 1) + (A - 1) * cw - sA);
+                na0 = (A + 1) - (A - 1) * cw + sA; na1 = 2 * ((A - 1) - (A + 1) * cw); na2 = (A + 1) - (A - 1) * cw - sA;
+                break;
+
+            case BIQUAD_LOWPASS:
+                nb0 = (1 - cw) / 2; nb1 = 1 - cw; nb2 = (1 - cw) / 2;
+                na0 = 1 + alpha; na1 = -2 * cw; na2 = 1 - alpha;
+                break;
+
+            default:
+                nb0 = (1 + cw) / 2; nb1 = -(1 + cw); nb2 = (1 + cw) / 2;
+                na0 = 1 + alpha; na1 = -2 * cw; na2 = 1 - alpha;
+                break;
+        }
+
+        b0 = nb0 / na0; b1 = nb1 / na0; b2 = nb2 / na0;
+        a1 = na1 / na0; a2 = na2 / na0;
+    }
+
+    // Keeps the response when the stream rate changes
+    void redesign(double rate) {
+        design(type, rate, freq, gain_db, q);
+    }
+
+    void process(float* buf, size_t frames, int channels) {
+        for (int ch = 0; ch < channels; ch++) {
+            float s1 = z1[ch], s2 = z2[ch];
+
+            for (size_t i = ch; i < frames * channels; i += channels) {
+                float in = buf[i];
+                float out = b0 * in + s1;
+
+                s1 = b1 * in - a1 * out + s2;
+                s2 = b2 * in - a2 * out;
+                buf[i] = out;
+            }
+
+            z1[ch] = s1;
+            z2[ch] = s2;
+        }
+    }
+};
+
+// Per-stream gain, stereo balance and EQ. Gain and pan move to their targets
+// with a linear ramp over one block, so changes do not click.
+// work must hold one block of float samples and is allocated by the owner.
+struct dsp_chain_t {
+    float gain = 1;
+    float gain_target = 1;
+    float pan = 0;
+    float pan_target = 0;
+
+    biquad_t eq[DSP_MAX_BANDS];
+
+    float* work = nullptr;
+    size_t work_size = 0;
+
+    bool bypass() {
+        if (gain != 1 || gain_target != 1 || pan != 0 || pan_target != 0) return false;
+        for (biquad_t& band : eq) if (band.type != BIQUAD_OFF) return false;
+        return true;
+    }
+
+    void process(char* buffer, size_t size, int width, int channels) {
+        if (bypass() || channels > DSP_MAX_CHANNELS) return;
+
+        size_t samples = std::min(size / (width / 8), work_size);
+        size_t frames = samples / channels;
+        float* __restrict w = work;
+
+        if (width == 32) {
+            const int32_t* in = (const int32_t*)buffer;
+            for (size_t i = 0; i < samples; i++) w[i] = in[i] * (1.0f / 2147483648.0f);
+        } else {
+            const int16_t* in = (const int16_t*)buffer;
+            for (size_t i = 0; i < samples; i++) w[i] = in[i] * (1.0f / 32768.0f);
+        }
+
+        for (biquad_t& band : eq) if (band.type != BIQUAD_OFF) band.process(w, frames, channels);
+
+        float step = frames ? 1.0f / frames : 0;
+        float dgain = (gain_target - gain) * step;
+
+        if (channels == 2) {
+            float dpan = (pan_target - pan) * step;
+
+            for (size_t i = 0; i < frames; i++) {
+                float g = gain + dgain * i;
+                float p = pan + dpan * i;
+
+                w[i * 2] *= g * std::min(1.0f, 1 - p);
+                w[i * 2 + 1] *= g * std::min(1.0f, 1 + p);
+            }
+        } else {
+            for (size_t i = 0; i < frames; i++) {
+                float g = gain + dgain * i;
+                for (int ch = 0; ch < channels; ch++) w[i * channels + ch] *= g;
+            }
+        }
+
+        gain = gain_target;
+        pan = pan_target;
+
+        if (width == 32) {
+            int32_t* out = (int32_t*)buffer;
+            for (size_t i = 0; i < samples; i++) out[i] = std::clamp(w[i] * 2147483648.0f, -2147483648.0f, 2147483520.0f);
+        } else {
+            int16_t* out = (int16_t*)buffer;
+            for (size_t i = 0; i < samples; i++) out[i] = std::clamp(w[i] * 32768.0f, -32768.0f, 32767.0f);
+        }
+    }
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+#include "../wavheader.hpp"
+#include "protocol.hpp"
+#include "codec.hpp"
+#include "chmap.hpp"
+
+// What a client sends on the control socket before it is admitted to a sink
+struct tail_handshake_t {
+    wav_header_t header = {};
+    tail_stream_mode_t mode = PLAYBACK;
+    int volume = 100;
+    std::string sink;
+    codec_t codec = CODEC_PCM;
+    int capture_pb_id = 0;
+    bool drm_playback = false;
+    tail_stream_class_t stream_class = CLASS_MUSIC;
+};
+
+// Copies a client's header and bounds every field the server sizes buffers or picks code paths from.
+// Returns the error reply, or an empty string if the stream can be served.
+std::string tail_header_check(const char* buffer, size_t size, wav_header_t& header) {
+    if (!buffer || size < sizeof(wav_header_t)) return "Error: Malformed header.";
+
+    memcpy(&header, buffer, sizeof(wav_header_t));
+
+    // plain PCM or WAVE_FORMAT_EXTENSIBLE
+    if (header.audioFormat != 1 && (uint16_t)header.audioFormat != 0xfffe) return "Error: Unsupported sample format.";
+    if (header.numChannels < 1 || header.numChannels > CHMAP_MAX_CHANNELS) return "Error: Unsupported channel count.";
+    if (header.bitsPerSample != 16 && header.bitsPerSample != 32) return "Error: Unsupported sample width.";
+    if (header.sampleRate < 8000 || header.sampleRate > 384000) return "Error: Unsupported sample rate.";
+
+    return "";
+}
+
+// Reads and checks a handshake through reader, which provides std::string msg() and int byte() (0..255).
+// The client sends every field before it waits for a reply, so the mode specific ones are read
+// whenever the mode is known. Returns the error reply, or an empty string if the stream can be served
+// by a sink that exists; the sink itself is looked up by the caller.
+template <typename reader_t>
+std::string tail_handshake_parse(reader_t& reader, tail_handshake_t& handshake) {
+    std::string header = reader.msg();
+    int mode = reader.byte();
+    handshake.volume = reader.byte();
+    handshake.sink = reader.msg();
+    int codec = reader.byte();
+
+    if (mode > CAPTURE_PB) return "Error: Unknown stream mode.";
+    handshake.mode = (tail_stream_mode_t)mode;
+
+    // 0 is the master bus
+    if (mode == CAPTURE_PB) handshake.capture_pb_id = atoi(reader.msg().c_str());
+
+    if (mode == PLAYBACK) {
+        handshake.drm_playback = reader.byte();
+        handshake.stream_class = (tail_stream_class_t)std::min(reader.byte(), CLASS_COUNT - 1);
+    }
+
+    std::string error = tail_header_check(header.data(), header.size(), handshake.header);
+    if (!error.empty()) return error;
+
+    if (codec > CODEC_FLAC) return "Error: Unknown codec.";
+    handshake.codec = (codec_t)codec;
+
+    if (!codec_supported(handshake.codec, handshake.header.sampleRate, handshake.header.numChannels, handshake.header.bitsPerSample)) return "Error: Unsupported codec format.";
+
+    return "";
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cmath>
+#include <algorithm>
+
+// Interarrival jitter estimate (RFC 3550, 6.4.1) against the media clock of the stream.
+// All values are in seconds. A transit jump of more than max_gap is a discontinuity
+// (pause, stalled sender) and rebases the clock instead of counting as jitter,
+// smaller deviations are capped at max_deviation per sample.
+struct jitter_estimator_t {
+    double jitter = 0;
+    double media_time = 0;
+    double last_transit = 0;
+    bool started = false;
+
+    static constexpr double max_gap = 1.0;
+    static constexpr double max_deviation = 0.2;
+
+    void arrival(double now, double duration) {
+        double transit = now - media_time;
+        double deviation = std::fabs(transit - last_transit);
+
+        if (started && deviation < max_gap) jitter += (std::min(deviation, max_deviation) - jitter) / 16;
+
+        last_transit = transit;
+        media_time += duration;
+        started = true;
+    }
+
+    // The next arrival starts a new reference, the estimate itself is kept
+    void reset() {
+        started = false;
+    }
+
+    // An underrun means the estimate was too optimistic, and the sender stalled
+    void underrun(double period) {
+        jitter = std::max(jitter * 2, period);
+        reset();
+    }
+};
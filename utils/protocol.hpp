@@ -0,0 +1,37 @@
+#pragma once
+
+// Wire protocol constants shared by the server, clients and tests/.
+
+enum tail_stream_mode_t {
+    PLAYBACK,
+    CAPTURE,
+	CAPTURE_PB
+};
+
+// Playback stream classes in ascending priority, a playing class ducks every class below it
+enum tail_stream_class_t {
+    CLASS_MUSIC,
+    CLASS_NOTIFICATION,
+    CLASS_VOICE,
+    CLASS_ALARM,
+    CLASS_COUNT
+};
+
+// Control socket commands. Any unknown byte is treated as CMD_CLOSE.
+enum tail_control_cmd_t {
+    CMD_CLOSE,
+    CMD_LATENCY,
+    CMD_SET_GAIN,
+    CMD_SET_PAN,
+    CMD_SET_EQ,
+    CMD_RECONFIGURE,
+    CMD_RECORD,
+    CMD_RECORD_MASTER,
+    CMD_PLAY_FILE,
+    CMD_PAUSE,
+    CMD_RESUME,
+    CMD_SET_VOLUME,
+    CMD_FLUSH,
+    CMD_DRAIN,
+    CMD_STATS
+};
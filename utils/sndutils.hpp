@@ -1,7 +1,10 @@
+#pragma once
 #include <cstdint>
 #include <cstring>
 #include <cmath>
 #include <limits>
+#include <cstdlib>
+#include <algorithm>
 
 // int32_t bytes2num(const char* bytes, size_t size) {
 //     int32_t ret = 0;
@@ -26,7 +29,9 @@ size_t convert_16_to_32(const char* data, char* dest, size_t size, bool use_resa
     int16_t* buf16 = new int16_t[samples];
     int32_t* buf32 = new int32_t[samples];
 
-    memcpy(buf16, data, size);
+    // a trailing partial sample is dropped, or zero padded when resampling
+    memset(buf16, 0, samples * sizeof(int16_t));
+    memcpy(buf16, data, std::min(size, samples * sizeof(int16_t)));
 
     for (size_t i = 0; i < samples; i++) buf32[i] = ((int32_t)buf16[i]) << 16;
 
@@ -47,7 +52,8 @@ size_t convert_32_to_16(const char* data, char* dest, size_t size, bool use_resa
     int32_t* buf32 = new int32_t[samples];
     int16_t* buf16 = new int16_t[samples];
 
-    memcpy(buf32, data, size);
+    memset(buf32, 0, samples * sizeof(int32_t));
+    memcpy(buf32, data, std::min(size, samples * sizeof(int32_t)));
 
     for (size_t i = 0; i < samples; i++) buf16[i] = (int16_t)(buf32[i] >> 16);
 
@@ -62,14 +68,15 @@ void volume_convert(const char* buffer, char* dest, size_t size, int volume) {
     int16_t* buf = (int16_t*)buffer;
     int16_t* dbuf = (int16_t*)dest;
 
-    for (size_t i = 0; i < size / sizeof(int16_t); i++) dbuf[i] = buf[i] / 100 * volume;
+    // volumes above 100 amplify, the result saturates instead of wrapping
+    for (size_t i = 0; i < size / sizeof(int16_t); i++) dbuf[i] = std::clamp<int64_t>((int64_t)buf[i] * volume / 100, INT16_MIN, INT16_MAX);
 }
 
 void volume_convert32(const char* buffer, char* dest, size_t size, int volume) {
     int32_t* buf = (int32_t*)buffer;
     int32_t* dbuf = (int32_t*)dest;
 
-    for (size_t i = 0; i < size / sizeof(int32_t); i++) dbuf[i] = buf[i] / 100 * volume;
+    for (size_t i = 0; i < size / sizeof(int32_t); i++) dbuf[i] = std::clamp<int64_t>((int64_t)buf[i] * volume / 100, INT32_MIN, INT32_MAX);
 }
 
 void sound_mix(const char* buffer, const char* buffer2, char* dest, size_t size) {
@@ -218,4 +225,60 @@ size_t convert_stereo_to_mono32(const char* buffer, char* dest, size_t size) {
     delete[] chbuf1;
     delete[] chbuf2;
     return newsize;
-}
\ No newline at end of file
+}
+
+// Mixes buffer2, ramped from gain to gain_end, into buffer like sound_mix.
+// Returns the peak of buffer2 before the gain (0..1), so callers can follow its envelope in the same pass.
+float sound_mix_gain(const char* buffer, const char* buffer2, char* dest, size_t size, float gain, float gain_end) {
+    int16_t* buf1 = (int16_t*)buffer;
+    int16_t* buf2 = (int16_t*)buffer2;
+    int16_t* dbuf = (int16_t*)dest;
+
+    size_t samples = size / sizeof(int16_t);
+    float step = samples ? (gain_end - gain) / samples : 0;
+    int peak = 0;
+
+    for (size_t i = 0; i < samples; i++) {
+        int32_t sample1 = buf1[i];
+        int32_t sample2 = buf2[i] * (gain + step * i);
+
+        peak = std::max(peak, std::abs((int32_t)buf2[i]));
+
+        if (sample1 < 0 && sample2 < 0)
+        dbuf[i] = (sample1 + sample2) - (sample1 * sample2) / std::numeric_limits<int16_t>::min();
+
+        else if (sample1 > 0 && sample2 > 0)
+        dbuf[i] = (sample1 + sample2) - (sample1 * sample2) / std::numeric_limits<int16_t>::max();
+
+        else dbuf[i] = std::clamp(sample1 + sample2, (int32_t)std::numeric_limits<int16_t>::min(), (int32_t)std::numeric_limits<int16_t>::max());
+    }
+
+    return peak / 32768.0f;
+}
+
+float sound_mix_gain32(const char* buffer, const char* buffer2, char* dest, size_t size, float gain, float gain_end) {
+    int32_t* buf1 = (int32_t*)buffer;
+    int32_t* buf2 = (int32_t*)buffer2;
+    int32_t* dbuf = (int32_t*)dest;
+
+    size_t samples = size / sizeof(int32_t);
+    float step = samples ? (gain_end - gain) / samples : 0;
+    int64_t peak = 0;
+
+    for (size_t i = 0; i < samples; i++) {
+        int64_t sample1 = buf1[i];
+        int64_t sample2 = buf2[i] * (double)(gain + step * i);
+
+        peak = std::max(peak, std::abs((int64_t)buf2[i]));
+
+        if (sample1 < 0 && sample2 < 0)
+        dbuf[i] = (sample1 + sample2) - (sample1 * sample2) / std::numeric_limits<int32_t>::min();
+
+        else if (sample1 > 0 && sample2 > 0)
+        dbuf[i] = (sample1 + sample2) - (sample1 * sample2) / std::numeric_limits<int32_t>::max();
+
+        else dbuf[i] = std::clamp(sample1 + sample2, (int64_t)std::numeric_limits<int32_t>::min(), (int64_t)std::numeric_limits<int32_t>::max());
+    }
+
+    return peak / 2147483648.0f;
+}
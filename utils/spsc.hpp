@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <atomic>
+#include <algorithm>
+
+// Lock-free byte ring for one producer and one consumer thread.
+// The capacity is rounded up to a power of two, head and tail only ever grow.
+class spsc_ring_t {
+    char* data = nullptr;
+    size_t mask = 0;
+
+    alignas(64) std::atomic<size_t> head = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+
+    public:
+    spsc_ring_t(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+
+        data = new char[size];
+        mask = size - 1;
+    }
+
+    ~spsc_ring_t() {
+        delete[] data;
+    }
+
+    spsc_ring_t(const spsc_ring_t&) = delete;
+    spsc_ring_t& operator=(const spsc_ring_t&) = delete;
+
+    size_t capacity() {
+        return mask + 1;
+    }
+
+    size_t usage() {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    // Producer: writes all of buffer or nothing, never blocks
+    bool push(const char* buffer, size_t size) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+
+        if (capacity() - (h - t) < size) return false;
+
+        size_t pos = h & mask;
+        size_t first = std::min(size, capacity() - pos);
+
+        memcpy(data + pos, buffer, first);
+        memcpy(data, buffer + first, size - first);
+
+        head.store(h + size, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: the largest contiguous readable span, valid until pop()
+    size_t peek(const char** span) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+
+        size_t pos = t & mask;
+        *span = data + pos;
+
+        return std::min(h - t, capacity() - pos);
+    }
+
+    void pop(size_t size) {
+        tail.store(tail.load(std::memory_order_relaxed) + size, std::memory_order_release);
+    }
+
+    // Consumer: copies up to size bytes across the wrap, returns how many were read
+    size_t read(char* dest, size_t size) {
+        size_t done = 0;
+        const char* span;
+
+        while (done < size) {
+            size_t len = std::min(peek(&span), size - done);
+            if (!len) break;
+
+            memcpy(dest + done, span, len);
+            pop(len);
+            done += len;
+        }
+
+        return done;
+    }
+};
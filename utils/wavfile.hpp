@@ -0,0 +1,282 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../wavheader.hpp"
+#include "spsc.hpp"
+
+// wav_header_t keeps its sizes in 32 bit signed fields
+#define WAV_MAX_DATA_SIZE (0x7fffffff - 36)
+
+wav_header_t wav_header_make(int rate, int channels, int width, uint32_t data_size) {
+    wav_header_t header;
+
+    memcpy(header.chunkID, "RIFF", 4);
+    memcpy(header.format, "WAVE", 4);
+    memcpy(header.subchunk1ID, "fmt ", 4);
+    memcpy(header.subchunk2ID, "data", 4);
+
+    header.chunkSize = 36 + data_size;
+    header.subchunk1Size = 16;
+    header.audioFormat = 1;
+    header.numChannels = channels;
+    header.sampleRate = rate;
+    header.byteRate = rate * channels * (width / 8);
+    header.blockAlign = channels * (width / 8);
+    header.bitsPerSample = width;
+    header.subchunk2Size = data_size;
+
+    return header;
+}
+
+// Records interleaved PCM to "<stem>-<date>-<n>.wav" files on a background thread.
+// push() is wait-free, so the audio thread never touches the disk: data goes through an
+// spsc ring and is written in large sequential chunks. The header is rewritten after every
+// chunk, so a file is valid even if the server dies, and a new file is started whenever
+// max_bytes or max_seconds of audio has been written (0 disables either limit).
+class wav_writer_t {
+    public:
+    std::string path;
+    std::string file;
+    std::atomic<uint64_t> dropped = 0;
+
+    private:
+    std::string stem;
+    int rate;
+    int channels;
+    int width;
+    size_t limit;
+
+    spsc_ring_t ring;
+    std::thread writer;
+    std::atomic<bool> stop = false;
+
+    int fd = -1;
+    int sequence = 0;
+    uint32_t data_size = 0;
+    bool failed = false;
+    int open_failures = 0;
+    int retry_ticks = 0;
+
+    bool write_all(const char* buffer, size_t size) {
+        while (size) {
+            ssize_t len = ::write(fd, buffer, size);
+
+            if (len < 0 && errno == EINTR) continue;
+            if (len <= 0) return false;
+
+            buffer += len;
+            size -= len;
+        }
+
+        return true;
+    }
+
+    void update_header() {
+        wav_header_t header = wav_header_make(rate, channels, width, data_size);
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) failed = true;
+    }
+
+    bool open_file() {
+        char date[32];
+        time_t now = time(nullptr);
+        strftime(date, sizeof(date), "%Y%m%d-%H%M%S", localtime(&now));
+
+        file = stem + "-" + date + "-" + std::to_string(sequence++) + ".wav";
+        fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+
+        data_size = 0;
+        failed = false;
+
+        wav_header_t header = wav_header_make(rate, channels, width, 0);
+        if (write_all((const char*)&header, sizeof(header))) return true;
+
+        // a full disk would otherwise leave an empty file behind for every retry
+        ::close(fd);
+        ::unlink(file.c_str());
+        fd = -1;
+        return false;
+    }
+
+    // Reopens after a failure on the first tick, then backs off to once a minute
+    void retry_open() {
+        if (retry_ticks > 0) {
+            retry_ticks--;
+            return;
+        }
+
+        if (open_file()) open_failures = 0;
+        else retry_ticks = std::min(1 << std::min(open_failures++, 8), 240) - 1;
+    }
+
+    void close_file() {
+        if (fd < 0) return;
+
+        update_header();
+        ::close(fd);
+        fd = -1;
+    }
+
+    void run() {
+        while (true) {
+            // stop is read first, so everything pushed before it was set still gets written
+            bool stopping = stop;
+
+            // a file that failed, or could not be opened after a rotation, is retried with a backoff
+            if (failed) close_file();
+            if (fd < 0 && !stopping) retry_open();
+
+            const char* span;
+            size_t size;
+
+            while ((size = ring.peek(&span))) {
+                // without a file the data is discarded, so the ring keeps draining
+                if (fd < 0 || failed) {
+                    dropped += size;
+                    ring.pop(size);
+                    continue;
+                }
+
+                size = std::min<size_t>(size, limit - data_size);
+
+                if (write_all(span, size)) data_size += size;
+                else failed = true;
+
+                ring.pop(size);
+
+                if (!failed && data_size >= limit) {
+                    close_file();
+                    retry_open();
+                }
+            }
+
+            if (fd >= 0 && !failed) update_header();
+            if (stopping) break;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        }
+
+        close_file();
+    }
+
+    public:
+    // the ring holds two seconds of audio, four times the write interval
+    wav_writer_t(std::string path, int rate, int channels, int width, size_t max_bytes, int max_seconds) :
+        path(path), rate(rate), channels(channels), width(width), ring(std::max<size_t>((size_t)rate * channels * (width / 8) * 2, 1 << 20)) {
+        size_t block_align = channels * (width / 8);
+
+        stem = (path.size() > 4 && path.compare(path.size() - 4, 4, ".wav") == 0) ? path.substr(0, path.size() - 4) : path;
+
+        limit = WAV_MAX_DATA_SIZE;
+        if (max_bytes) limit = std::min(limit, max_bytes);
+        if (max_seconds) limit = std::min(limit, (size_t)max_seconds * rate * block_align);
+
+        limit = std::max(limit / block_align * block_align, block_align);
+    }
+
+    ~wav_writer_t() {
+        stop = true;
+
+        if (writer.joinable()) writer.join();
+        else close_file();
+    }
+
+    bool start() {
+        if (!open_file()) return false;
+
+        writer = std::thread(&wav_writer_t::run, this);
+        return true;
+    }
+
+    // Called by the audio thread, drops the block if the disk cannot keep up
+    void push(const char* buffer, size_t size) {
+        if (!ring.push(buffer, size)) dropped += size;
+    }
+};
+
+// Memory-maps a PCM WAV file. header is normalized to a plain 44 byte PCM header,
+// data points to the samples and stays valid as long as the reader.
+class wav_reader_t {
+    int fd = -1;
+    char* map = nullptr;
+    size_t map_size = 0;
+
+    public:
+    wav_header_t header = {};
+    const char* data = nullptr;
+    size_t size = 0;
+
+    wav_reader_t() {}
+
+    wav_reader_t(const wav_reader_t&) = delete;
+    wav_reader_t& operator=(const wav_reader_t&) = delete;
+
+    ~wav_reader_t() {
+        if (map) munmap(map, map_size);
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool open(const std::string& path) {
+        struct stat st;
+
+        if ((fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) return false;
+        if (fstat(fd, &st) < 0 || st.st_size < 12) return false;
+
+        map_size = st.st_size;
+        map = (char*)mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED) {
+            map = nullptr;
+            return false;
+        }
+
+        madvise(map, map_size, MADV_SEQUENTIAL);
+
+        if (memcmp(map, "RIFF", 4) || memcmp(map + 8, "WAVE", 4)) return false;
+
+        bool fmt = false;
+
+        // chunks are word aligned, a data chunk with a bogus size (streamed files) runs to the end of the file
+        for (size_t pos = 12; pos + 8 <= map_size;) {
+            const char* id = map + pos;
+            uint32_t chunk_size;
+            memcpy(&chunk_size, map + pos + 4, 4);
+
+            pos += 8;
+            size_t avail = map_size - pos;
+
+            if (!memcmp(id, "fmt ", 4) && chunk_size >= 16 && avail >= 16) {
+                memcpy(&header.audioFormat, map + pos, 16);
+
+                // WAVE_FORMAT_EXTENSIBLE carries the real format in the first bytes of its subformat GUID
+                if ((uint16_t)header.audioFormat == 0xfffe && chunk_size >= 40 && avail >= 40) memcpy(&header.audioFormat, map + pos + 24, 2);
+
+                fmt = true;
+            } else if (!memcmp(id, "data", 4)) {
+                data = map + pos;
+                size = (chunk_size && chunk_size <= avail) ? chunk_size : avail;
+                break;
+            }
+
+            pos += chunk_size + (chunk_size & 1);
+        }
+
+        if (!fmt || !data || header.audioFormat != 1 || header.numChannels < 1 || header.bitsPerSample < 8) return false;
+
+        size = size / (header.numChannels * (header.bitsPerSample / 8)) * (header.numChannels * (header.bitsPerSample / 8));
+        header = wav_header_make(header.sampleRate, header.numChannels, header.bitsPerSample, std::min<size_t>(size, WAV_MAX_DATA_SIZE));
+
+        return true;
+    }
+};